@@ -0,0 +1,29 @@
+#ifndef __BINARY_DESCRIPTOR_H_INCLUDED_
+#define __BINARY_DESCRIPTOR_H_INCLUDED_
+
+#include <iostream>
+#include <vector>
+
+#include <opencv2/opencv.hpp>
+#include <opencv2/core/core.hpp>
+
+using namespace std;
+using namespace cv;
+
+// binary descriptors (ORB, AKAZE) are rows of CV_8U, the float ones (SIFT) rows of CV_32F
+inline bool isBinaryDescriptor(const Mat &descriptors)
+{
+    return descriptors.depth() == CV_8U;
+}
+
+// hamming distance of two binary descriptors of n bytes, OpenCV dispatches it to its SIMD popcount
+inline int hammingDistance(const uchar *a, const uchar *b, int n)
+{
+    return cv::normHamming(a, b, n);
+}
+
+// descriptors as CV_32F rows for the float algorithms (k-means, PQ). a binary descriptor becomes one 0/1 value per bit,
+// so the squared L2 distance of two rows is their hamming distance
+void toFloatDescriptors(const Mat &descriptors, Mat &data);
+
+#endif
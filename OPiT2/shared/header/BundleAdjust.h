@@ -12,27 +12,80 @@
 #include <pcl/point_cloud.h>
 
 #include "Frame.h"
+#include "SparseBundleAdjuster.h"
+#include "RingBuffer.h"
 
 #include <iostream>
+#include <unordered_map>
+#include <future>
 
 using namespace std;
 using namespace cv;
 
+enum
+{
+    BA_BACKEND_CVSBA  = 0,                                  // cvsba on the dense visibility
+    BA_BACKEND_NATIVE = 1                                   // SparseBundleAdjuster on the observation list
+};
+
+// optimized position of a landmark, the version is the adjustment that wrote it
+struct LandmarkRecord
+{
+    Point3d             position;
+    int                 version;
+};
+
+// output of one adjustment of a window snapshot, handed back to the live window by updateData
+struct BundleResult
+{
+    int                 version;
+    vector<int>         frameIdx;                           // frames of the snapshot
+    vector<Mat>         R, T;                               // rotation vector and translation of every frame (world to camera)
+    vector<Point3d>     points3D;
+    vector<int>         pointIds;                           // landmark id of every point of points3D (-1 if none)
+    vector<vector<int> > pointIndices;                      // index inside points3D of every matched point of every frame
+    Pose                correction;                         // change of the newest frame, before^-1 * after
+    double              repError;
+};
+
 class BundleAdjust
 {
 public:
     BundleAdjust();
     ~BundleAdjust();
 
-    void run(vector<Frame> &);
-    void prepareData(vector<Point3d> &, vector<vector<Point2d> > &, vector<vector<int> > &,
+    void setBackend(int backend);
+    // the recent poses of the motion model are adjusted together with the window
+    void run(RingBuffer<Frame> &, vector<TrackedPose> &);
+
+    // adjusts a snapshot of the window on a background thread, returns false if the last one is still running
+    bool runAsync(const RingBuffer<Frame> &);
+    // hands the finished adjustment back to the window, returns false if there is nothing to merge yet
+    bool merge(RingBuffer<Frame> &, vector<TrackedPose> &);
+    bool isRunning();
+
+    void prepareData(vector<Point3d> &, vector<Observation> &, vector<vector<Point2d> > &, vector<vector<int> > &,
                      vector<Mat> &, vector<Mat> &, vector<Mat> &, vector<Mat> &);
-    void updateData(vector<Point3d>, vector<Mat>, vector<Mat>, vector<Frame> &);
+    void prepareObservations(vector<Point3d> &, vector<Observation> &);
+    void toDense(const vector<Observation> &, int numOfPoints, vector<vector<Point2d> > &, vector<vector<int> > &);
+    void updateData(const BundleResult &, RingBuffer<Frame> &, vector<TrackedPose> &);
     int  getWindowSize();
 private:
+    void   solve(BundleResult &);
+    void   snapshot(const RingBuffer<Frame> &);
+    double runNative(vector<Point3d> &, const vector<Observation> &, vector<Mat> &, vector<Mat> &);
+
+    int                 backend;
     cvsba::Sba          sba;
     cvsba::Sba::Params  params;
-    vector<Frame>       trackedFrame;
+    SparseBundleAdjuster sparse;
+    vector<Frame>       trackedFrame;                       // snapshot of the poses and matches of the window, owned by the adjustment while it runs
+    vector<vector<int> > pointIndices;
+    vector<int>         pointIds;
+
+    int                 version;                            // number of started adjustments
+    future<BundleResult> pending;
+    unordered_map<int, LandmarkRecord> landmarks;           // optimized landmarks still in the window, the next window starts from them
 };
 
 #endif
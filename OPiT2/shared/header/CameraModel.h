@@ -0,0 +1,48 @@
+#ifndef __CAMERA_MODEL_H_INCLUDED_
+#define __CAMERA_MODEL_H_INCLUDED_
+
+#include <iostream>
+#include <vector>
+
+#include <opencv2/opencv.hpp>
+#include <opencv2/core/core.hpp>
+
+using namespace std;
+using namespace cv;
+
+class CameraModel
+{
+public:
+    // constructor & destructor, the default one takes the intrinsics from Calibration
+    CameraModel();
+    CameraModel(Mat cameraMatrix, Mat distCoeffs);
+    ~CameraModel();
+
+    // the model is immutable after construction, so it can be shared between threads
+    Mat                 getCameraMatrix() const;
+    Mat                 getInverseCameraMatrix() const;
+    Mat                 getDistortionCoeffs() const;
+    const Matx33d&      getK() const;
+    const Matx33d&      getKinv() const;
+    bool                hasDistortion() const;
+
+    // undistorted pixel coordinates (same camera matrix, zero distortion)
+    void                undistort(const vector<Point2d> &points, vector<Point2d> &undistorted) const;
+
+    // the model of the same camera for an image resized by factor, e.g. 0.5 for half resolution
+    CameraModel         scaled(double factor) const;
+    static Mat          scaleCameraMatrix(Mat cameraMatrix, double factor);
+
+    double              fx, fy, cx, cy;
+
+private:
+    void                init(Mat cameraMatrix, Mat distCoeffs);
+
+    Mat                 cameraMatrix;                       // 3x3,     intrinsic matrix (double)
+    Mat                 cameraMatrixInv;                    // 3x3,     its inverse
+    Mat                 distCoeffs;                         // 1x5,     distortion coefficients (empty if none)
+    Matx33d             K, Kinv;
+    bool                distorted;
+};
+
+#endif
@@ -6,6 +6,7 @@
 #include <string>
 #include <vector>
 #include <thread>
+#include <atomic>
 #include <opencv2/opencv.hpp>
 #include <opencv2/core/core.hpp>
 
@@ -14,6 +15,8 @@
 #include <pcl/point_cloud.h>
 #include <pcl/kdtree/kdtree_flann.h>
 
+#include "LandmarkTable.h"
+
 using namespace std;
 using namespace std::chrono;
 using namespace cv;
@@ -32,31 +35,42 @@ public:
     void reportElapsedTime();
     void reportElapsedTime(string);
 
+    //landmark ids, unique over the whole run
+    static int  newLandmarkId();
+    static int  newLandmarkIds(int count);
+    static void reserveLandmarkIds(int nextId);
+
     //logging
     static void createDir(const string dirname);
     void readCsvTo3D2D(char *fileName, vector<Point3d> &worldPoints, vector<Point2d> &imagePoints);
 
     //preparemap
     void prepareMap (string mapCoordinateFile, string mapKeypointsFile, vector<Point2d> &tunnel2Dx, vector<Point3d> &tunnel3Dx, Mat &tunnelDescriptor);
-    void updatelut (vector<Point3d>, Mat, vector< pair<Point3d, Mat> > &);
+    void updatelut (vector<Point3d>, Mat, LandmarkTable &);    // the landmarks get new ids
     void threading(int numofthreads, Mat T, Mat K, vector<KeyPoint> detectedkpts, Mat descriptor,
                    pcl::PointCloud<pcl::PointXYZ>::Ptr& cloud, pcl::KdTreeFLANN<pcl::PointXYZ>& kdtree,
-                   vector<pair<Point3d, Mat> > &lookuptable, vector<Point3d> &tunnel3D, vector<Point2d> &tunnel2D, vector<int> &tunnel1D);
-    Mat getdescriptor (vector< pair<Point3d, Mat> >);
+                   LandmarkTable &lookuptable, vector<Point3d> &tunnel3D, vector<Point2d> &tunnel2D, vector<int> &tunnel1D);
+    void threading(int numofthreads, Mat T, Mat K, vector<KeyPoint> detectedkpts, Mat descriptor, vector<int> keypointIds,
+                   pcl::PointCloud<pcl::PointXYZ>::Ptr& cloud, pcl::KdTreeFLANN<pcl::PointXYZ>& kdtree,
+                   LandmarkTable &lookuptable, vector<Point3d> &tunnel3D, vector<Point2d> &tunnel2D, vector<int> &tunnel1D,
+                   vector<int> &tunnelIds);
+    Mat getdescriptor (const LandmarkTable &);                 // view of the descriptors, no copy
 
 private:
     high_resolution_clock::time_point t1, t2;
     double elapsedTime;
 
     mutex                  g_mutex;
-    void calcBestPoint ( Mat T, Mat K, vector<KeyPoint> imagepoint, Mat descriptor,
+    void calcBestPoint ( Mat T, Mat K, vector<KeyPoint> imagepoint, Mat descriptor, vector<int> keypointIds,
                     pcl::PointCloud<pcl::PointXYZ>::Ptr& cloud, pcl::KdTreeFLANN<pcl::PointXYZ>& kdtree,
                     int start, int end, int tidx,
-                    vector<pair<Point3d, Mat> > &vocabulary,
+                    LandmarkTable &vocabulary,
                     vector<Point3d> &projected3D,
                     vector<Point2d> &projected2D,
-                    vector<int> &projectedIndex);
+                    vector<int> &projectedIndex,
+                    vector<int> &projectedIds);
     vector<thread> workers;
+    static atomic<int> landmarkCounter;
 };
 
 #endif
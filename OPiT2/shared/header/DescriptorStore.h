@@ -0,0 +1,70 @@
+#ifndef __DESCRIPTOR_STORE_H_INCLUDED_
+#define __DESCRIPTOR_STORE_H_INCLUDED_
+
+#include <iostream>
+#include <fstream>
+#include <string>
+#include <vector>
+
+#include <opencv2/opencv.hpp>
+#include <opencv2/core/core.hpp>
+
+using namespace std;
+using namespace cv;
+
+class DescriptorStore
+{
+public:
+    // constructor & destructor
+    DescriptorStore();
+    DescriptorStore(int numOfSubspaces, int numOfCentroids);
+    ~DescriptorStore();
+
+    // training of the OPQ rotation and the PQ codebooks, opqIterations = 0 gives a plain PQ. the descriptors
+    // already in the store are encoded again. without codebooks the store keeps the full-precision descriptors only
+    void train(Mat descriptors, int opqIterations);
+
+    // the codebooks together with the number of stored descriptors and their codes, the map of the next run.
+    // load needs the raw file opened first, it returns false without codebooks
+    bool save(string filename);
+    bool load(string filename);
+    bool empty();
+
+    // the full-precision descriptors are written to this file (kept over the runs), only the codes are kept in memory
+    bool open(string rawFilename);
+
+    // encode and append descriptors, returns the index of the first appended descriptor
+    int  add(Mat descriptors);
+    int  size();
+    int  getCodeSize();
+
+    // read back the full-precision descriptors from disk
+    void getDescriptors(const vector<int> &indices, Mat &descriptors);
+
+    // k nearest neighbours of every query among the candidates, using the asymmetric distance and exact re-ranking of the best ones
+    // (exact distances to every candidate without codebooks). to follow the ratio test convention, queryIdx is the position
+    // inside candidates and trainIdx the row of queryDescriptors. the distance is L2 for float and hamming for binary queries
+    void knnSearch(Mat queryDescriptors, const vector<int> &candidates, int k, int rerank, vector<vector<DMatch> > &matches);
+
+private:
+    void pad(const Mat &descriptors, Mat &padded);
+    void encodeStored();
+    void trainCodebooks(Mat data, int iterations);
+    void encode(const float *rotated, uchar *code);
+    void decode(const uchar *code, float *rotated);
+    void computeDistanceTable(const float *rotated, float *table);
+
+    int                     numOfSubspaces;             // M,       bytes per encoded descriptor
+    int                     numOfCentroids;             // Ks,      centroids per subspace (max 256)
+    int                     paramCentroids;             //          requested Ks, the trained one is limited by the training size
+    int                     dims;                       // D,       descriptor length
+    int                     subDims;                    // D/M,     subspace length (rounded up, the descriptors are zero padded)
+    Mat                     rotation;                   // DxD,     OPQ rotation of the padded space (identity for plain PQ)
+    Mat                     codebooks;                  // (M*Ks)x(D/M), centroids of every subspace
+
+    vector<uchar>           codes;                      // size N*M, all encoded descriptors
+    int                     numOfDescriptors;
+    fstream                 rawFile;                    // size NxD, full-precision descriptors (float)
+};
+
+#endif
@@ -9,6 +9,14 @@
 
 #include "Frame.h"
 
+// descriptor type of the localization pipeline
+enum
+{
+	FEATURE_SIFT  = 0,		// float, 128 values
+	FEATURE_ORB   = 1,		// binary, 256 bits
+	FEATURE_AKAZE = 2		// binary, 486 bits (MLDB)
+};
+
 // TODO: future mod on the class naming
 class FeatureDetection
 {
@@ -22,6 +30,24 @@ public:
 	// set SIFT param
 	void setSiftParam(int octave, double contrastThreshold, double edgeThreshold, double sigma, double ratio);
 
+	// set the descriptor type of extractFeatures and describeKeypoints, the matchers follow the type of the descriptors.
+	// the map files (lookup table, vocabulary, codebooks) have to be built with the same type
+	void setFeatureType(int type);
+	int  getFeatureType();
+
+	// set the tiling of siftTiledExtraction, tilesX x tilesY tiles with overlap pixels of support and at most budget keypoints each
+	void setTileParam(int tilesX, int tilesY, int overlap, int budget);
+
+	// set the resolution of the SIFT base octave relative to the frame, 2.0 is the upsampled octave of OpenCV, 1.0 the
+	// native and 0.5 the half resolution. if refine, the keypoints found below 2.0 are refined on the full resolution frame
+	void setScaleParam(double scale, bool refine);
+
+	// set the keypoint selection of extractFeatures, at most budget keypoints spread over a gridX x gridY grid (0 keeps all)
+	void setSelectionParam(int gridX, int gridY, int budget);
+
+	// if lazy, extractFeatures only detects and the descriptors are computed by describeKeypoints when they are needed
+	void setLazyDescriptors(bool lazy);
+
 
     // the wrapper
     void computeKeypointsAndDraw(char *pathname);
@@ -32,14 +58,51 @@ public:
 	void siftDetector(cv::Mat img, std::vector<cv::KeyPoint>& detectedPoints, cv::Mat mask);
     void surfDetector(cv::Mat img, std::vector<cv::KeyPoint>& detectedPoints);
 
-    // methods for extracting the features
-    void siftExtraction (cv::Mat img, std::vector<cv::KeyPoint> detectedPoints, cv::Mat &descriptor);
-    void surfExtraction (cv::Mat img, std::vector<cv::KeyPoint> detectedPoints, cv::Mat &descriptor);
+    // methods for extracting the features, the keypoints without a descriptor are removed
+    void siftExtraction (cv::Mat img, std::vector<cv::KeyPoint> &detectedPoints, cv::Mat &descriptor);
+    void surfExtraction (cv::Mat img, std::vector<cv::KeyPoint> &detectedPoints, cv::Mat &descriptor);
+
+    // detection and description on the same scale space, instead of building it once for each
+    void siftDetectAndCompute (cv::Mat img, cv::Mat mask, std::vector<cv::KeyPoint> &detectedPoints, cv::Mat &descriptor);
+
+    // detection and description per image tile on the thread pool (SIFT or the type of setFeatureType), the keypoints of every tile are
+    // kept inside its own area, so the merged result has no duplicates at the tile borders. without describe it only detects
+    void siftTiledExtraction (cv::Mat img, cv::Mat mask, std::vector<cv::KeyPoint> &detectedPoints, cv::Mat &descriptor, bool describe = true);
+
+    // the feature front-end of a frame, tiled if there is more than one tile and at the resolution of setScaleParam. the
+    // keypoints are always in the coordinates of img, so the full resolution camera matrix holds for them. the keypoints
+    // and descriptors are written into the buffers of the frame, and its keypoint ids are reset
+    void extractFeatures (cv::Mat img, cv::Mat mask, Frame &frame);
+
+    // computes the missing descriptors of the given keypoints (all without indices) on the feature image of the frame,
+    // returns the number of computed ones. the keypoints the extractor drops keep a zero row, Frame::describedKeypoints leaves them out
+    int describeKeypoints (Frame &frame, const std::vector<int> &indices);
+    int describeKeypoints (Frame &frame);
+
+    // the keypoints within radius pixels of any predicted image point, e.g. the window landmarks projected with the pose prior
+    void candidateKeypoints (const std::vector<cv::KeyPoint> &keypoints, const std::vector<cv::Point2d> &predicted,
+                             double radius, std::vector<int> &indices);
+
+    // adaptive non-maximal suppression with a cap per grid cell, it keeps at most budget keypoints (and their descriptor
+    // rows) of an image of imageSize. the keypoints are ranked by their response times the backprojection rate of their cell
+    void selectKeypoints (std::vector<cv::KeyPoint> &keypoints, cv::Mat &descriptor, cv::Size imageSize);
+
+    // learns the backprojection rate of every grid cell from a mapped frame, reprojectedIndices are the keypoints that hit the cloud
+    void updateBackprojection (const std::vector<cv::KeyPoint> &keypoints, const std::vector<int> &reprojectedIndices);
+
+    // moves the keypoints to the subpixel blob/corner center in img, window is the half size of the search window
+    void refineKeypoints (cv::Mat img, std::vector<cv::KeyPoint> &keypoints, int window);
 
 	// methods for matching descriptors
     void bfMatcher (cv::Mat trainDesc, cv::Mat queryDesc, std::vector<std::vector<cv::DMatch> > &matches);
 	void ratioTest (std::vector<std::vector<cv::DMatch> > &, std::vector<int> &, std::vector<int> &);
     void ratioTestRansac (vector<vector<DMatch> > &, Frame &, Frame &, bool);
+
+    // mutual (cross-check) matching, forward and backward best matches in one distance sweep. the mutual matches
+    // passing the ratio test are sorted by their ratio (scores), best first
+    void mutualMatcher (cv::Mat queryDesc, cv::Mat trainDesc, std::vector<cv::DMatch> &matches, std::vector<float> &scores);
+    void mutualRansac (vector<DMatch> &, vector<float> &, Frame &, Frame &, bool);
+
     // draw keypoints
     void drawKeypoints (cv::Mat img, std::vector<cv::KeyPoint> detectedPoints, cv::Mat &output);
 
@@ -59,6 +122,11 @@ private:
     // pointer to the matcher object
     cv::Ptr<cv::DescriptorMatcher> matcher_;
 
+    // detector and extractor of extractFeatures
+    int feature_type;
+    cv::Ptr<cv::Feature2D> feature_;
+    cv::Ptr<cv::Feature2D> createFeature(int budget);
+
     // fast param
     int fast_threshold;
     bool nonMaxSuppression;
@@ -72,6 +140,29 @@ private:
     double edge_threshold;
     double sigma;
     double sift_matching_ratio;
+
+    // tiling param
+    int tile_cols;
+    int tile_rows;
+    int tile_overlap;
+    int tile_budget;
+
+    // resolution param
+    double feature_scale;
+    bool refine_subpixel;
+
+    // selection param
+    int select_cols;
+    int select_rows;
+    int select_budget;
+    cv::Size select_size;					// frame size of the grid
+    std::vector<double> cell_tries;			// size select_cols*select_rows, decayed number of backprojected keypoints
+    std::vector<double> cell_hits;			// size select_cols*select_rows, decayed number of them that hit the cloud
+
+    // descriptor param
+    bool lazy_descriptors;
+
+    int gridCell (const cv::Point2f &pt);
 };
 
 #endif
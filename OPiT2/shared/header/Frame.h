@@ -8,31 +8,53 @@
 #include <opencv2/core/core.hpp>
 
 #include "Common.h"
+#include "Pose.h"
 
 using namespace std;
 using namespace cv;
 
+// lifecycle of a frame, every transition drops the data that the next stages don't need
+enum
+{
+    FRAME_DECODED  = 0,                                     // image loaded
+    FRAME_FEATURED = 1,                                     // keypoints and descriptors extracted, the image is released (not the feature image)
+    FRAME_POSED    = 2,                                     // pose estimated, the raw matches are released
+    FRAME_MAPPED   = 3                                      // landmarks backprojected into the lookup table, the features and descriptors are released
+};
+
 class Frame
 {
 public:
     // all informations regarding frame data
     int                         frameIdx;                   // frame index
-    Mat                         image;                      // image file
+    int                         stage;                      // lifecycle stage, FRAME_DECODED to FRAME_MAPPED
+    Mat                         image;                      // image file, only until the features are extracted
+    vector <uchar>              thumbnail;                  // jpeg of the image at quarter resolution, only kept for debugging
+    Mat                         featureImage;               // image the keypoints were detected on, kept while descriptors are computed lazily
+    double                      featureScale;               // size of the feature image relative to the frame
     Mat                         descriptors;                // size Nx128,  all descriptors for keypoints
+    vector <uchar>              described;                  // size N,      1 if the row of descriptors is computed, 2 if the extractor dropped the keypoint
     vector <KeyPoint>           keypoints;                  // size N,      all keypoints from SIFT detector
+    vector <int>                keypointIds;                // size N,      landmark id matched to every keypoint (-1 if none)
 
     vector<vector<DMatch> >     matches;                    // size M,      all matches from feature matching
 
     vector <Point3d>            matchedWorldPoints;         // size M',     all 3d points from lookup table matching
-    vector <Point3d>            c_matchedWorldPoints;       // size K,      all 3d points reprojected points (camera coordinate)
+    PointSet3d                  c_matchedWorldPoints;       // size M',     matched 3d points in camera coordinate (structure of arrays)
     vector <Point2d>            matchedImagePoints;         // size M',     all 2d points from the matching
+    vector <float>              matchedScores;              // size M',     matching score (Lowe's ratio) of every correspondence, lower is better
+    vector <int>                matchedIds;                 // size M',     landmark id of every correspondence
+    vector <int>                matchedKeypoints;           // size M',     keypoint index of every correspondence
 
     vector <Point3d>            reprojectedWorldPoints;     // size K,      all 3d points reprojected from all keypoints (world coordinate)
-    vector <Point3d>            c_reprojectedWorldPoints;   // size K,      all 3d points reprojected points (camera coordinate)
+    PointSet3d                  c_reprojectedWorldPoints;   // size K,      all 3d points reprojected points (camera coordinate)
     vector <Point2d>            reprojectedImagePoints;     // size K,      all 2d points that successfully backprojected
     vector <int>                reprojectedIndices;         // size K,      indices for allcorresponding 3d/2d backprojected points
+    vector <int>                reprojectedIds;             // size K,      landmark id of every backprojected point (same order as _3dToDescriptor)
 
-    vector<pair<Point3d, Mat> > _3dToDescriptor;            // size K,      all backprojected 3d points + descriptors
+    LandmarkTable               _3dToDescriptor;            // size K,      all backprojected 3d points + descriptors + landmark ids
+
+    Pose                        pose;                       // world to camera, the Mat fields below are filled from it by setPose
 
     Mat                         K;                          // 3x3,         intrinsic matrix
     Mat                         R;                          // 3x3,         rotation matrix
@@ -42,14 +64,28 @@ public:
     Mat                         t_invert;                   // 1x3,         this is the camera position in the world space
     Mat                         t_translation;              // 1x3,         represent the translation from previous camera pose
     Mat                         distCoef;                   // 1x5,         distortion coefficients
-    Mat                         cameraPose;                 // 3x4,         inverse matrices
+    Mat                         cameraPose;                 // 4x4,         camera to world
 
 // method
     Frame();
     ~Frame();
 
+    // the destructor would suppress the implicit moves, frames are moved in and out of the window
+    Frame(const Frame &) = default;
+    Frame(Frame &&) = default;
+    Frame&                      operator=(const Frame &) = default;
+    Frame&                      operator=(Frame &&) = default;
+
+    void                        setPose(const Pose &pose);  // set the pose and its Mat forms (R, R_rodrigues, t, inverses, cameraPose)
     void                        projectWorldtoCamera();     // project world space 3d points into camera space
     void                        projectCameratoWorld();     // project camera space 3d points into world
+    void                        sortMatchedPoints();        // sort the 3d/2d correspondences by their matching score, one per keypoint
+    void                        setKeypointId(int keypointIdx, int landmarkId);     // remember the landmark matched to a keypoint
+    void                        advance(int stage, bool keepThumbnail = false);     // move to a later stage, releasing what it doesn't need
+    Mat                         getThumbnail() const;       // decoded thumbnail, empty if none was kept
+    Mat                         getDescriptors(const vector<int> &indices) const;   // copy of the descriptor rows of the given keypoints
+    vector<int>                 describedKeypoints(const vector<int> &indices) const;   // the given keypoints whose descriptor is computed
+    vector<int>                 describedKeypoints() const;                         // every keypoint whose descriptor is computed
     
 private:
 };
@@ -0,0 +1,62 @@
+#ifndef __FRAME_PREPROCESSOR_H_INCLUDED_
+#define __FRAME_PREPROCESSOR_H_INCLUDED_
+
+#include <iostream>
+#include <vector>
+#include <string>
+
+#include <opencv2/opencv.hpp>
+#include <opencv2/core/core.hpp>
+
+using namespace std;
+using namespace cv;
+
+// the preprocessing of every frame before the feature extraction: grayscale, undistortion and an optional downscale.
+// the remap tables and the ROI mask only depend on the image size, so they are built once per size instead of per frame
+class FramePreprocessor
+{
+public:
+    // constructor & destructor, the default one takes the intrinsics from Calibration
+    FramePreprocessor();
+    FramePreprocessor(Mat cameraMatrix, Mat distCoeffs);
+    ~FramePreprocessor();
+
+    void                setGrayscale(bool gray);
+    void                setUndistort(bool undistort);
+    void                setScale(double scale);
+
+    // the ROI as fractions of the image, e.g. (0, 0, 1, 7/8) drops the dashboard. a mask file (white = keep) replaces it
+    void                setRoi(Rect2d roi);
+    bool                loadMask(string filename);
+
+    // preprocess a frame into out. the intermediate buffers are kept for the next frame, and out is only written by the
+    // last stage. without any stage out shares the pixels of image
+    void                apply(const Mat &image, Mat &out);
+
+    // the ROI mask of the last applied frame, or of the output of an input image of imageSize, undistorted and scaled like the frames
+    const Mat&          getMask() const;
+    const Mat&          getMask(Size imageSize);
+
+    // the intrinsics of the output frames, the distortion is empty once the frames are undistorted
+    Mat                 getCameraMatrix() const;
+    Mat                 getDistortionCoeffs() const;
+
+private:
+    void                configure(Size imageSize);
+
+    Mat                 cameraMatrix;                       // 3x3,     intrinsics of the input frames
+    Mat                 distCoeffs;                         // 1x5,     their distortion (empty if none)
+    bool                gray;
+    bool                undistort;
+    double              scale;
+    Rect2d              roi;
+    Mat                 fileMask;                           // mask loaded from a file, at its own size
+
+    Size                imageSize;                          // configured input size
+    Size                outputSize;
+    Mat                 map1, map2;                         // fixed-point undistortion tables (CV_16SC2, CV_16UC1)
+    Mat                 mask;                               // ROI mask of the output frames
+    Mat                 grayBuffer, remapBuffer;            // intermediate stages, reused every frame
+};
+
+#endif
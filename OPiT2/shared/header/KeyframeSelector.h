@@ -0,0 +1,45 @@
+#ifndef __KEYFRAME_SELECTOR_H_INCLUDED_
+#define __KEYFRAME_SELECTOR_H_INCLUDED_
+
+#include <iostream>
+#include <vector>
+#include <unordered_map>
+
+#include <opencv2/opencv.hpp>
+#include <opencv2/core/core.hpp>
+
+#include "Frame.h"
+
+using namespace std;
+using namespace cv;
+
+class KeyframeSelector
+{
+public:
+    // constructor & destructor
+    KeyframeSelector();
+    KeyframeSelector(double minDistance, double minParallax, double minTrackedRatio, int maxInterval);
+    ~KeyframeSelector();
+
+    // decides if a tracked frame (with its pose) adds new landmarks to the map and enters the window
+    bool isKeyframe(const Frame &current, int numOfInliers);
+
+    // remember the keyframe after its backprojection, the next frames are compared against it
+    void setKeyframe(const Frame &keyframe, int numOfInliers);
+
+private:
+    double                      medianParallax(const Frame &current);
+
+    double                      minDistance;                // travelled distance since the last keyframe (in meter)
+    double                      minParallax;                // median image motion of the landmarks of the last keyframe (in pixel)
+    double                      minTrackedRatio;            // inliers compared to the last keyframe
+    int                         maxInterval;                // max number of frames between two keyframes
+
+    bool                        hasKeyframe;
+    int                         lastFrameIdx;
+    int                         lastInliers;
+    double                      distance;                   // accumulated t_translation since the last keyframe
+    unordered_map<int, Point2d> lastImagePoints;            // landmark id -> image point in the last keyframe
+};
+
+#endif
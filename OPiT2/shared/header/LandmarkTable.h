@@ -0,0 +1,50 @@
+#ifndef __LANDMARK_TABLE_H_INCLUDED_
+#define __LANDMARK_TABLE_H_INCLUDED_
+
+#include <iostream>
+#include <vector>
+
+#include <opencv2/opencv.hpp>
+#include <opencv2/core/core.hpp>
+
+using namespace std;
+using namespace cv;
+
+// the 3D-to-descriptor lookup table as structure of arrays. the descriptors live in one contiguous block (the arena)
+// which grows geometrically, so appending doesn't reallocate every frame and the matcher reads a view of it
+class LandmarkTable
+{
+public:
+    // constructor & destructor
+    LandmarkTable();
+    ~LandmarkTable();
+
+    void                        reserve(int capacity, int descriptorCols, int descriptorType);
+    void                        append(const Point3d &position, const Mat &descriptor, int id);
+    void                        append(const vector<Point3d> &positions, const Mat &descriptors, const vector<int> &ids);
+
+    // keeps the arena for the next appends
+    void                        clear();
+
+    int                         size() const;
+    bool                        empty() const;
+    const Point3d&              getPosition(int i) const;
+    void                        setPosition(int i, const Point3d &position);    // e.g. the landmark optimized by the bundle adjustment
+    int                         getId(int i) const;
+    const vector<Point3d>&      getPositions() const;
+    const vector<int>&          getIds() const;
+
+    // views of the arena, no copy. they stay valid until the table grows
+    Mat                         getDescriptors() const;
+    Mat                         getDescriptor(int i) const;
+
+private:
+    void                        grow(int rows, int cols, int type);
+
+    vector<Point3d>             positions;                  // size N
+    vector<int>                 ids;                        // size N,      landmark ids
+    Mat                         arena;                      // size CxD,    descriptors, the first N rows are used
+    int                         count;
+};
+
+#endif
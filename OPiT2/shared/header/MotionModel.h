@@ -0,0 +1,41 @@
+#ifndef __MOTION_MODEL_H_INCLUDED_
+#define __MOTION_MODEL_H_INCLUDED_
+
+#include <iostream>
+#include <vector>
+
+#include <opencv2/opencv.hpp>
+#include <opencv2/core/core.hpp>
+
+#include "Pose.h"
+
+using namespace std;
+using namespace cv;
+
+enum
+{
+    MOTION_CONSTANT_VELOCITY     = 0,
+    MOTION_CONSTANT_ACCELERATION = 1
+};
+
+class MotionModel
+{
+public:
+    // constructor & destructor
+    MotionModel();
+    MotionModel(int model, int maxGap);
+    ~MotionModel();
+
+    // predict the pose (world to camera, rodrigues rotation + translation) of frameIdx from the recent frames, oldest first.
+    // returns false if there are not enough frames, or if the last one is more than maxGap frames away
+    bool predict(const vector<TrackedPose> &frames, int frameIdx, Mat &rvec, Mat &tvec);
+
+private:
+    // motion per frame index between two poses, as rotation vector and translation
+    void velocity(const TrackedPose &from, const TrackedPose &to, Vec3d &omega, Vec3d &v);
+
+    int                         model;                      // constant velocity or constant acceleration
+    int                         maxGap;                     // max number of frames between the last pose and the prediction
+};
+
+#endif
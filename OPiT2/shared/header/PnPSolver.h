@@ -4,13 +4,60 @@
 #include <opencv2/features2d.hpp>
 #include <initializer_list>
 #include <iostream>
+
+#include "CameraModel.h"
+#include "Pose.h"
+
+enum
+{
+	PNP_RANSAC_OPENCV = 0,		// solvePnPRansac with a fixed number of iterations
+	PNP_RANSAC_PROSAC = 1		// PROSAC sampling + local optimization, the points have to be ordered by match quality
+};
+
+// one pose problem of a batch, the parameters allow to evaluate several hypotheses on the same correspondences
+struct PnPProblem
+{
+	std::vector<cv::Point3d> worldPoints;
+	std::vector<cv::Point2d> imagePoints;
+	CameraModel camera;
+
+	int iterCount;
+	int repError;
+	double confidence;
+	int method;
+
+	PnPProblem() : iterCount(1000), repError(5), confidence(0.99), method(PNP_RANSAC_PROSAC) {}
+};
+
+struct PnPResult
+{
+	bool success;
+	cv::Mat rvec, tvec;						// world to camera
+	cv::Mat cameraPose;						// 4x4, camera to world
+	std::vector<uchar> inlierMask;			// size N, 1 for the inliers
+	int numInliers;
+	double time;							// solving time in ms
+
+	PnPResult() : success(false), numInliers(0), time(0) {}
+};
+
 class PnPSolver
 {
 public:
 	PnPSolver();
+	PnPSolver(const CameraModel &camera);
 	PnPSolver(int iterCount, int repError, double confidence);
 
 	void setPnPParam(int iterCount, int repError, double confidence);
+	void setRansacMethod(int method);
+	// the camera of the image points, CameraModel::scaled if they are on a resized image. the keypoints of
+	// FeatureDetection::extractFeatures are always in frame coordinates, at any feature scale
+	void setCameraModel(const CameraModel &camera);
+
+	// predicted pose for the next run (world to camera, like the output of solvePnP), e.g. from the motion model.
+	// the correspondences farther than gateError pixels from their predicted projection are discarded
+	void setPosePrior(cv::Mat rvec, cv::Mat tvec, double gateError);
+
 	void setWorldPoints();
 	void setWorldPoints(std::vector<cv::Point3d> WP);
 	std::vector<cv::Point3d> getWorldPoints();
@@ -19,7 +66,10 @@ public:
 	void setImagePoints(std::vector<cv::Point2d> IP);
 	std::vector<cv::Point2d> getImagePoints();
 
+	// the Mat outputs are built from the pose on every call
+	const Pose& getPose();
 	cv::Mat getCameraPose();
+	cv::Mat getCameraPose34();
 	cv::Mat getCameraPosition();
 
 	cv::Mat getRotationVector();
@@ -28,6 +78,8 @@ public:
 	cv::Mat getRotationMatrix();
 	cv::Mat getTranslationMatrix();
 
+	cv::Mat getInliers();
+
 	cv::Mat getEssentialMatrix();
 	cv::Mat getFundamentalMatrix();
 
@@ -36,22 +88,43 @@ public:
 
 	int run(int verbal);
 
-	std::vector<cv::Mat> camPositions;
-	cv::Mat cameraPose34;
+	// solves every problem concurrently on the OpenCV thread pool, every problem gets its own solver
+	static void solveBatch(const std::vector<PnPProblem> &problems, std::vector<PnPResult> &results);
+
 	cv::Mat R, t;
 
 private:
+	void prepareCorrespondences();
+	bool solveWithPrior();
+	bool solveProsac();
+	void optimizePose(Pose &pose, const std::vector<uchar> &mask, int iterations);
+	int  refinePose(Pose &pose, double threshold, std::vector<uchar> &mask);
+	int  scoreModel(const Pose &pose, double threshold, std::vector<uchar> &mask);
+	void setResult(const Pose &centered, const std::vector<uchar> &mask);
 
 	std::vector<cv::Point2d> imagePoints, imagePoints2;
 	std::vector<cv::Point3d> worldPoints;
 	std::vector<std::vector<cv::Point2d> > VoVImagePoints;
 
+	CameraModel camera;
+
 	cv::Mat essentialMatrix, fundamentalMatrix;
 
-	cv::Mat rVec, tVec;
-	cv::Mat rMat, tMat;
-	cv::Mat cameraPose, cameraPosition;
+	Pose pose;								// world to camera
+	cv::Mat inliers;
+
+	// centered world points and undistorted image points of the current run, also as structure of arrays for the batch scoring
+	cv::Point3d centroid;
+	std::vector<cv::Point3d> centeredPoints;
+	std::vector<cv::Point2d> undistortedPoints;
+	std::vector<double> soaX, soaY, soaZ, soaU, soaV;
+	std::vector<uchar> scratchMask;
+
+	Pose prior;
+	bool hasPrior;
+	double paramPriorGate;
 
+	int paramRansacMethod;
 	int paramIterCount;
 	int paramRepError;
 	double paramConfidence;
@@ -0,0 +1,64 @@
+#ifndef __POSE_H_INCLUDED_
+#define __POSE_H_INCLUDED_
+
+#include <iostream>
+#include <vector>
+
+#include <opencv2/opencv.hpp>
+#include <opencv2/core/core.hpp>
+
+using namespace std;
+using namespace cv;
+
+// 3d points as structure of arrays, the batch transforms stream through the three coordinate arrays
+struct PointSet3d
+{
+    vector<double>              x, y, z;
+
+    int                         size() const;
+    void                        resize(int n);
+    void                        clear();
+    void                        push_back(const Point3d &p);
+    Point3d                     operator[](int i) const;
+    void                        toPoints(vector<Point3d> &points) const;
+};
+
+// a compact rigid transform on fixed-size matrices, x_cam = R * X_world + t (like the output of solvePnP)
+struct Pose
+{
+    Matx33d                     R;
+    Vec3d                       t;
+
+    // constructor
+    Pose();
+    Pose(const Matx33d &R, const Vec3d &t);
+    static Pose fromRodrigues(Mat rvec, Mat tvec);
+
+    Vec3d                       transform(const Vec3d &X) const;        // world to camera
+
+    // batch transforms, one branch-free loop over all points
+    void                        transform(const vector<Point3d> &world, PointSet3d &camera) const;
+    void                        inverseTransform(const PointSet3d &camera, vector<Point3d> &world) const;
+    Pose                        inverse() const;                        // camera to world
+    Vec3d                       getCameraPosition() const;              // -R^t * t
+    Pose                        operator*(const Pose &other) const;
+
+    // left-multiplied update, x' = exp(omega) * x + v, with delta = [v, omega]
+    void                        update(const Vec6d &delta);
+
+    // Mat outputs, only built on request
+    Mat                         getRotationVector() const;              // 3x1
+    Mat                         getRotationMatrix() const;              // 3x3
+    Mat                         getTranslationVector() const;           // 3x1
+    Mat                         getCameraPose() const;                  // 4x4, camera to world
+    Mat                         getCameraPose34() const;                // 3x4, camera to world
+};
+
+// the pose of a tracked frame without the rest of the frame, e.g. for the motion model
+struct TrackedPose
+{
+    int                         frameIdx;
+    Pose                        pose;
+};
+
+#endif
@@ -0,0 +1,75 @@
+#ifndef __RELOCALIZATION_H_INCLUDED_
+#define __RELOCALIZATION_H_INCLUDED_
+
+#include <iostream>
+#include <map>
+#include <string>
+#include <vector>
+
+#include <opencv2/opencv.hpp>
+#include <opencv2/core/core.hpp>
+
+#include "VocabularyTree.h"
+#include "DescriptorStore.h"
+#include "LandmarkTable.h"
+
+using namespace std;
+using namespace cv;
+
+class Relocalization
+{
+public:
+    // constructor & destructor
+    Relocalization();
+    Relocalization(int branching, int depth, double segmentLength);
+    ~Relocalization();
+
+    // load the offline vocabulary, false if there is none yet. the map descriptors then give a vocabulary for this run only
+    bool prepareVocabulary(string vocabularyFile, Mat mapDescriptors);
+
+    // train the vocabulary from the descriptors of the whole map (e.g. the backprojected landmarks of a run) and save it
+    bool trainVocabulary(string vocabularyFile, Mat mapDescriptors);
+
+    // keep the map descriptors compressed in the store instead of memory, it has to be set before adding landmarks
+    void setDescriptorStore(DescriptorStore *store);
+
+    // the landmarks of the tunnel map (positions, ids and their rows in the store) over the runs. a compressed map is
+    // loaded after its store, false if there is none or it doesn't match the store
+    bool save(string mapFilename);
+    bool load(string mapFilename);
+
+    // insert landmarks (and their ids) into the tunnel map, grouped into segments along the tunnel
+    void addLandmarks(const LandmarkTable &landmarks);
+
+    // retrieve the landmarks of the best scored segments for the query descriptors, returns the number of segments
+    int  retrieve(Mat queryDescriptors, int numOfSegments, vector<pair<Point3d, Mat> > &candidates);
+
+    // same as above for a compressed map, returns the landmarks, their ids and their indices inside the descriptor store
+    int  retrieve(Mat queryDescriptors, int numOfSegments, vector<Point3d> &candidatePoints, vector<int> &candidateIds, vector<int> &candidateIndices);
+
+    int  getNumSegments();
+    int  getNumLandmarks();
+    int  getMaxLandmarkId();                                // -1 for an empty map
+
+private:
+    struct Segment
+    {
+        vector<Point3d>         points;                     // size S,      landmarks of the segment
+        vector<int>             ids;                        // size S,      their landmark ids
+        Mat                     descriptors;                // size Sx128,  corresponding descriptors (uncompressed map)
+        vector<int>             storeIndices;               // size S,      indices inside the descriptor store (compressed map)
+    };
+
+    int  getSegmentIdx(Point3d point);
+    void indexSegments();
+    void selectSegments(Mat queryDescriptors, int numOfSegments, vector<int> &segmentIndices);
+
+    VocabularyTree              vocabulary;
+    DescriptorStore             *store;
+    double                      segmentLength;              // length of the map segment (in meter)
+    map<pair<int, int>, int>    cellToSegment;              // ground plane cell to segment index
+    vector<Segment>             segments;
+    int                         numLandmarks;
+};
+
+#endif
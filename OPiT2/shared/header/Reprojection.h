@@ -13,6 +13,7 @@ public:
 
 	cv::Mat foo(cv::Mat,cv::Mat, cv::Mat, cv::Mat, cv::Mat, cv::Mat);
 
+	// K has to be the camera matrix of the resolution of imagepoint (see CameraModel::scaleCameraMatrix)
 	static std::vector<double> backproject(cv::Mat T, cv::Mat K, cv::Point2d imagepoint, pcl::PointCloud<pcl::PointXYZ>::Ptr &cloud, pcl::KdTreeFLANN<pcl::PointXYZ> &kdtree);
     static std::vector<double> backprojectRadius(cv::Mat T, cv::Mat	K, cv::Point2d imagepoint, pcl::PointCloud<pcl::PointXYZ>::Ptr &cloud, pcl::KdTreeFLANN<pcl::PointXYZ> &kdtree);
     static std::vector<double> LinearInterpolation(std::vector<double> bestPoint, cv::Mat origin, cv::Mat vectorPoint);
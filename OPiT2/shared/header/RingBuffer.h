@@ -0,0 +1,69 @@
+#ifndef __RING_BUFFER_H_INCLUDED_
+#define __RING_BUFFER_H_INCLUDED_
+
+#include <iostream>
+#include <vector>
+#include <utility>
+
+using namespace std;
+
+// fixed-capacity circular buffer, index 0 is the oldest element. the slots are allocated once and reused,
+// a push into a full buffer overwrites the oldest slot instead of shifting the others
+template <typename T>
+class RingBuffer
+{
+public:
+    // constructor
+    explicit RingBuffer(int capacity = 1) : slots(capacity), head(0), count(0) {}
+
+    int                         size() const                { return count; }
+    int                         capacity() const            { return slots.size(); }
+    bool                        empty() const               { return count == 0; }
+    bool                        full() const                { return count == slots.size(); }
+
+    T&                          operator[](int i)           { return slots[(head + i) % slots.size()]; }
+    const T&                    operator[](int i) const     { return slots[(head + i) % slots.size()]; }
+    T&                          front()                     { return (*this)[0]; }
+    T&                          back()                      { return (*this)[count - 1]; }
+
+    // moves the value into the next slot, evicting the oldest element if the buffer is full
+    T& push_back(T &&value)
+    {
+        slot() = std::move(value);
+        return back();
+    }
+
+    T& push_back(const T &value)
+    {
+        slot() = value;
+        return back();
+    }
+
+    // the slot keeps its content until it is overwritten
+    void pop_front()
+    {
+        head = (head + 1) % slots.size();
+        count--;
+    }
+
+    void clear()
+    {
+        head  = 0;
+        count = 0;
+    }
+
+private:
+    T& slot()
+    {
+        if (full())
+            pop_front();
+        count++;
+        return back();
+    }
+
+    vector<T>                   slots;
+    int                         head;
+    int                         count;
+};
+
+#endif
@@ -0,0 +1,16 @@
+#ifndef __ROBUST_LOSS_H_INCLUDED_
+#define __ROBUST_LOSS_H_INCLUDED_
+
+// huber loss of a reprojection error e (in pixel), quadratic up to h and linear beyond.
+// the pose refinement and the bundle adjustment score their steps with the same cost as their IRLS weights
+inline double huberCost(double e, double h)
+{
+    return (e <= h) ? 0.5 * e * e : h * (e - 0.5 * h);
+}
+
+inline double huberWeight(double e, double h)
+{
+    return (e <= h) ? 1.0 : h / e;
+}
+
+#endif
@@ -0,0 +1,61 @@
+#ifndef __SPARSE_BUNDLE_ADJUSTER_H_INCLUDED_
+#define __SPARSE_BUNDLE_ADJUSTER_H_INCLUDED_
+
+#include <iostream>
+#include <vector>
+
+#include <opencv2/opencv.hpp>
+#include <opencv2/core/core.hpp>
+
+#include "Pose.h"
+
+using namespace std;
+using namespace cv;
+
+typedef Matx<double, 2, 6> Matx26d;
+typedef Matx<double, 2, 3> Matx23d;
+typedef Matx<double, 6, 3> Matx63d;
+
+// one observation of a 3D point by a camera of the window
+struct Observation
+{
+    int                 cameraIdx;
+    int                 pointIdx;
+    Point2d             imagePoint;
+};
+
+class SparseBundleAdjuster
+{
+public:
+    // constructor & destructor
+    SparseBundleAdjuster();
+    ~SparseBundleAdjuster();
+
+    // the first numOfFixedCameras poses are kept fixed (gauge), huber is the robust kernel width in pixel
+    void   setParams(int iterations, double huber, int numOfFixedCameras);
+
+    // levenberg-marquardt over poses (world to camera) and points with fixed intrinsics, returns the final rms reprojection error.
+    // the damping of the last run is kept, so a window that only moved by one frame starts where the previous one ended
+    double run(vector<Pose> &poses, const vector<Matx33d> &K, vector<Point3d> &points, const vector<Observation> &observations);
+
+private:
+    // jacobians, residuals and weights of every observation
+    double linearize(const vector<Pose> &poses, const vector<Matx33d> &K, const vector<Vec3d> &points, const vector<Observation> &observations);
+    double evaluate(const vector<Pose> &poses, const vector<Matx33d> &K, const vector<Vec3d> &points, const vector<Observation> &observations);
+    double robustCost(double error);
+    double robustWeight(double error);
+
+    int                         iterations;
+    double                      huber;
+    int                         numOfFixedCameras;
+    double                      lambda;                     // damping of the last accepted step
+
+    vector<Matx26d>             Jc;                         // size O,      jacobian wrt the camera [v, omega]
+    vector<Matx23d>             Jp;                         // size O,      jacobian wrt the point
+    vector<Vec2d>               residuals;                  // size O
+    vector<double>              weights;                    // size O,      robust weights
+    vector<vector<int> >        byCamera;                   // size C,      observations of every camera
+    vector<vector<int> >        byPoint;                    // size P,      observations of every point
+};
+
+#endif
@@ -0,0 +1,57 @@
+#ifndef __SURFACE_MASK_H_INCLUDED_
+#define __SURFACE_MASK_H_INCLUDED_
+
+#include <iostream>
+#include <vector>
+
+#include <opencv2/opencv.hpp>
+#include <opencv2/core/core.hpp>
+
+#include <pcl/point_types.h>
+#include <pcl/point_cloud.h>
+#include <pcl/kdtree/kdtree_flann.h>
+
+#include "CameraModel.h"
+#include "Pose.h"
+
+using namespace std;
+using namespace cv;
+
+// the image regions with tunnel surface within the depth range of the backprojection, seen from a predicted pose.
+// the cloud points in range are splatted into a low resolution grid, every other region (the far tunnel opening,
+// the hood, the sky at the portal) can never backproject and is left out of the feature detection
+class SurfaceMask
+{
+public:
+    // constructor & destructor, the default depth range is the one of Reprojection::backproject
+    SurfaceMask();
+    SurfaceMask(double minDist, double maxDist, double scale, int margin);
+    ~SurfaceMask();
+
+    void                setDepthRange(double minDist, double maxDist);
+
+    // scale of the coverage grid to the frames, e.g. 0.125 is one cell per 8x8 pixels. the margin (in cells)
+    // grows the coverage for the error of the predicted pose
+    void                setResolution(double scale, int margin);
+
+    // the mask (CV_8U, 255 = surface) of frames of imageSize from the camera at pose (world to camera).
+    // false if the coverage is too small to be trusted, e.g. a wrong prediction, then the mask keeps everything
+    bool                render(const CameraModel &camera, Size imageSize, const Pose &pose,
+                               pcl::PointCloud<pcl::PointXYZ>::Ptr &cloud, pcl::KdTreeFLANN<pcl::PointXYZ> &kdtree,
+                               Mat &mask);
+
+private:
+    double              minDist;                            // depth range of the ray march (in meter)
+    double              maxDist;
+    double              scale;
+    int                 margin;
+
+    // kept between the frames
+    vector<int>         indices;
+    vector<float>       sqrDistances;
+    vector<Point3d>     cameraPoints;                       // distorted cameras only
+    vector<Point2d>     projectedPoints;
+    Mat                 coverage;                           // the low resolution grid
+};
+
+#endif
@@ -0,0 +1,59 @@
+#ifndef __VOCABULARY_TREE_H_INCLUDED_
+#define __VOCABULARY_TREE_H_INCLUDED_
+
+#include <iostream>
+#include <string>
+#include <vector>
+
+#include <opencv2/opencv.hpp>
+#include <opencv2/core/core.hpp>
+
+using namespace std;
+using namespace cv;
+
+class VocabularyTree
+{
+public:
+    // constructor & destructor
+    VocabularyTree();
+    VocabularyTree(int branching, int depth);
+    ~VocabularyTree();
+
+    // offline vocabulary, hierarchical k-means over the map descriptors
+    void train(Mat descriptors);
+    bool save(string filename);
+    bool load(string filename);
+    bool empty();
+
+    // a vocabulary below k^2 words can't tell the segments apart (e.g. trained on a handful of descriptors),
+    // it is neither saved nor loaded
+    bool usable();
+
+    // quantize a single descriptor (1xD, CV_32F) into its visual word
+    int  quantize(const float *descriptor);
+
+    // inverted file, every segment of the map holds a histogram of visual words
+    void addToSegment(int segmentIdx, Mat descriptors);
+    void clearSegments();
+
+    // returns the best scored segments (segment index, score) for the query descriptors
+    void query(Mat descriptors, int topN, vector<pair<int, double> > &candidates);
+
+    int  getNumWords();
+
+private:
+    void trainNode(int nodeIdx, Mat descriptors, int level);
+
+    int                                 branching;          // k, number of children for each node
+    int                                 depth;              // L, number of levels below the root
+    int                                 numWords;           // number of leaves
+    Mat                                 centers;            // size NxD,    cluster centers of every node (row 0 is the root)
+    vector<int>                         firstChild;         // size N,      index of the first child, -1 for leaves
+    vector<int>                         numChildren;        // size N,      number of children
+    vector<int>                         nodeWord;           // size N,      visual word of a leaf, -1 for inner nodes
+
+    vector<vector<pair<int, int> > >    invertedFile;       // size W,      (segment, occurrences) for every visual word
+    vector<int>                         segmentSize;        // size S,      total words inserted into every segment
+};
+
+#endif
@@ -0,0 +1,29 @@
+#include "BinaryDescriptor.h"
+
+#include <iostream>
+#include <vector>
+
+#include <opencv2/opencv.hpp>
+#include <opencv2/core/core.hpp>
+
+using namespace std;
+using namespace cv;
+
+void toFloatDescriptors(const Mat &descriptors, Mat &data)
+{
+    if (!isBinaryDescriptor(descriptors))
+    {
+        descriptors.convertTo(data, CV_32F);
+        return;
+    }
+
+    data.create(descriptors.rows, descriptors.cols * 8, CV_32F);
+    for (int i=0; i<descriptors.rows; i++)
+    {
+        const uchar *src = descriptors.ptr<uchar>(i);
+        float       *dst = data.ptr<float>(i);
+        for (int j=0; j<descriptors.cols; j++)
+            for (int b=0; b<8; b++)
+                dst[j*8 + b] = (float)((src[j] >> b) & 1);
+    }
+}
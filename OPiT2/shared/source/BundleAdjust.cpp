@@ -9,6 +9,13 @@
 #include <cvsba/cvsba.h>
 
 #include <iostream>
+#include <cmath>
+#include <limits>
+#include <algorithm>
+#include <chrono>
+#include <future>
+#include <unordered_map>
+#include <unordered_set>
 
 using namespace std;
 using namespace cv;
@@ -92,14 +99,102 @@ BundleAdjust::BundleAdjust()
     this->params.fixedDistortion = 5;           // 5, as mentioned in caltech camera calibration module
     this->params.verbose = true;
     this->sba.setParams(params);
+
+    this->backend = BA_BACKEND_NATIVE;
+    this->version = 0;
 }
 
 BundleAdjust::~BundleAdjust()
 {
-    // do nothing
+    // the background adjustment still uses the members
+    if (pending.valid())
+        pending.wait();
+}
+
+void BundleAdjust::setBackend(int backend)
+{
+    this->backend = backend;
+}
+
+/* ---------------------------------------------------------------------------------------------------------
+    visibility of the 3D points inside the window, as a sparse list of observations.
+    every matched point is looked up once by its landmark id (or, for frames without ids, by its position
+    quantized to FLT_THRESHOLD), so it costs O(number of matches) instead of comparing every point to every match
+   ---------------------------------------------------------------------------------------------------------*/
+static long long spatialKey(Point3d p)
+{
+    // 21 bits per axis, enough for a few kilometres of tunnel at 1 cm
+    long long x = (long long)floor(p.x / FLT_THRESHOLD) & 0x1FFFFF;
+    long long y = (long long)floor(p.y / FLT_THRESHOLD) & 0x1FFFFF;
+    long long z = (long long)floor(p.z / FLT_THRESHOLD) & 0x1FFFFF;
+    return (x << 42) | (y << 21) | z;
+}
+
+void BundleAdjust::prepareObservations(vector<Point3d> &points3D, vector<Observation> &observations)
+{
+    unordered_map<int, int>         idToPoint;
+    unordered_map<long long, int>   keyToPoint;
+    vector<int>                     lastCamera;             // the last camera observing every point
+
+    pointIndices.assign(trackedFrame.size(), vector<int>());
+    pointIds.clear();
+    for (int i=0; i<trackedFrame.size(); i++)
+    {
+        Frame &frame = trackedFrame[i];
+        bool hasIds  = (frame.matchedIds.size() == frame.matchedWorldPoints.size());
+
+        for (int k=0; k<frame.matchedWorldPoints.size(); k++)
+        {
+            int  pointIdx = points3D.size();
+            bool inserted;
+            if (hasIds)
+                inserted = idToPoint.insert(make_pair(frame.matchedIds[k], pointIdx)).second;
+            else
+                inserted = keyToPoint.insert(make_pair(spatialKey(frame.matchedWorldPoints[k]), pointIdx)).second;
+
+            if (inserted)
+            {
+                // warm start, a landmark that was already in the last window continues from its optimized position
+                unordered_map<int, LandmarkRecord>::iterator it = hasIds ? landmarks.find(frame.matchedIds[k]) : landmarks.end();
+                points3D.push_back((it != landmarks.end()) ? it->second.position : frame.matchedWorldPoints[k]);
+                pointIds.push_back(hasIds ? frame.matchedIds[k] : -1);
+                lastCamera.push_back(-1);
+            }
+            else
+                pointIdx = hasIds ? idToPoint[frame.matchedIds[k]] : keyToPoint[spatialKey(frame.matchedWorldPoints[k])];
+
+            // one observation per camera and point, the frame keeps its best match of a landmark first
+            // (sortMatchedPoints), a second one would conflict with it
+            pointIndices[i].push_back(pointIdx);
+            if (lastCamera[pointIdx] == i)
+                continue;
+            lastCamera[pointIdx] = i;
+
+            Observation observation = { i, pointIdx, frame.matchedImagePoints[k] };
+            observations.push_back(observation);
+        }
+        cout << "    window-" << i << "-th with " << frame.matchedWorldPoints.size() << " 3D points" << endl;
+    }
+}
+
+// cvsba takes a dense cameras x points visibility, only built at the boundary
+void BundleAdjust::toDense(const vector<Observation> &observations, int numOfPoints,
+                           vector<vector<Point2d> > &pointsImg, vector<vector<int> > &visibility)
+{
+    const double NaN = std::numeric_limits<double>::quiet_NaN();
+
+    visibility.assign(trackedFrame.size(), vector<int>(numOfPoints, 0));
+    pointsImg.assign(trackedFrame.size(), vector<Point2d>(numOfPoints, Point2d(NaN, NaN)));
+
+    for (int i=0; i<observations.size(); i++)
+    {
+        visibility[observations[i].cameraIdx][observations[i].pointIdx] = 1;
+        pointsImg[observations[i].cameraIdx][observations[i].pointIdx] = observations[i].imagePoint;
+    }
 }
 
 void BundleAdjust::prepareData(vector<Point3d> &points3D,
+                               vector<Observation> &observations,
                                vector<vector<Point2d> > &pointsImg,
                                vector<vector<int> > &visibility,
                                vector<Mat> &cameraMatrix,
@@ -107,147 +202,251 @@ void BundleAdjust::prepareData(vector<Point3d> &points3D,
                                vector<Mat> &T,
                                vector<Mat> &distCoeffs)
 {
-    // create a list of 3D and 2D from all frames inside window
+    // create a list of unique 3D points and their observations from all frames inside window
     cout << "  bundle adjustment..." << endl;
-    for (int i=0; i<this->trackedFrame.size(); i++)
+    prepareObservations(points3D, observations);
+    if (backend == BA_BACKEND_CVSBA)
+        toDense(observations, points3D.size(), pointsImg, visibility);
+    cout << "  visible items: " << observations.size() << " of " << points3D.size() << " 3D points" << endl;
+    
+    // append camera matrix, R, t and distCoeffs
+    for (int i=0; i<trackedFrame.size(); i++)
     {
-        // prepare all 3D points
-        points3D.insert(std::end(points3D), std::begin(trackedFrame[i].matchedWorldPoints), std::end(trackedFrame[i].matchedWorldPoints));
-        cout << "    window-" << i << "-th with " << trackedFrame[i].matchedWorldPoints.size() << " 3D points" << endl;
+        R.push_back(trackedFrame[i].pose.getRotationVector());
+        T.push_back(trackedFrame[i].pose.getTranslationVector());
+        cameraMatrix.push_back(trackedFrame[i].K);
+        distCoeffs.push_back((Mat1d(5,1) << 0, 0, 0, 0, 0));
     }
-    
-    // check duplicates of 3D points to some very small threshold and erase the duplicate
-    /*
-    std::sort(points3D.begin(), points3D.end(), comparePoint3D);
-    auto unique_end = std::unique(points3D.begin(), points3D.end(), equalPoint3D);
-    points3D.erase(unique_end, points3D.end()); */
-
-    // allocate 2D vectors
-    visibility.resize(this->trackedFrame.size());
-    pointsImg.resize(this->trackedFrame.size());
-    for (int i=0; i<this->trackedFrame.size(); i++)
+}
+
+/* ---------------------------------------------------------------------------------------------------------
+    merges an adjustment into the window. the frames of the snapshot take the optimized poses and points,
+    the frames tracked while the adjustment was running are moved by the correction of the newest adjusted frame
+    and take the landmarks written by this adjustment. a landmark record is only overwritten by a newer adjustment.
+    the lookup tables of the window, which the tracking matches against, take the landmarks of this adjustment too
+   ---------------------------------------------------------------------------------------------------------*/
+void BundleAdjust::updateData(const BundleResult &result, RingBuffer<Frame> &updatedFrame, vector<TrackedPose> &recentPoses)
+{
+    if (result.frameIdx.empty())
+        return;
+
+    for (int i=0; i<result.pointIds.size(); i++)
     {
-        visibility[i].resize(points3D.size());
-        pointsImg[i].resize(points3D.size());
-        
-        for (int j=0; j<points3D.size(); j++)
+        if (result.pointIds[i] < 0)
+            continue;
+
+        LandmarkRecord record = { result.points3D[i], result.version };
+        unordered_map<int, LandmarkRecord>::iterator it = landmarks.find(result.pointIds[i]);
+        if (it == landmarks.end())
+            landmarks.insert(make_pair(result.pointIds[i], record));
+        else if (it->second.version < result.version)
+            it->second = record;
+    }
+
+    int newestIdx = result.frameIdx.back();
+    for (int i=0; i<updatedFrame.size(); i++)
+    {
+        Frame &frame = updatedFrame[i];
+        int j = find(result.frameIdx.begin(), result.frameIdx.end(), frame.frameIdx) - result.frameIdx.begin();
+
+        Pose pose;
+        if (j < result.frameIdx.size())
+        {
+            pose = Pose::fromRodrigues(result.R[j], result.T[j]);
+
+            // update world points, a point seen by several frames is written back to all of them
+            if (result.pointIndices[j].size() == frame.matchedWorldPoints.size())
+                for (int k=0; k<result.pointIndices[j].size(); k++)
+                    frame.matchedWorldPoints[k] = result.points3D[result.pointIndices[j][k]];
+        }
+        else if (frame.frameIdx > newestIdx)
         {
-            pointsImg[i][j].x = std::numeric_limits<float>::quiet_NaN();
-            pointsImg[i][j].y = std::numeric_limits<float>::quiet_NaN();
+            pose = frame.pose * result.correction;
+
+            if (frame.matchedIds.size() == frame.matchedWorldPoints.size())
+                for (int k=0; k<frame.matchedIds.size(); k++)
+                {
+                    unordered_map<int, LandmarkRecord>::iterator it = landmarks.find(frame.matchedIds[k]);
+                    if (it != landmarks.end() && it->second.version == result.version)
+                        frame.matchedWorldPoints[k] = it->second.position;
+                }
         }
+        else
+            continue;
+
+        // update the pose with its matrices, then the matched points in camera coordinate in one batch
+        frame.setPose(pose);
+        frame.projectWorldtoCamera();
     }
-    
-    // check visibility by checking each elements inside points3D and returns visibility mask and corresponding
-    // 2d feature points (for each frame)
-    int count = 0;
-    int numOfCamera = trackedFrame.size();
-    for (int i=0; i<points3D.size(); i++)
+
+    // the same for the poses of the motion model, so its velocity doesn't mix poses from before and after
+    for (int i=0; i<recentPoses.size(); i++)
     {
-        for (int j=0; j<numOfCamera; j++)
+        int j = find(result.frameIdx.begin(), result.frameIdx.end(), recentPoses[i].frameIdx) - result.frameIdx.begin();
+        if (j < result.frameIdx.size())
+            recentPoses[i].pose = Pose::fromRodrigues(result.R[j], result.T[j]);
+        else if (recentPoses[i].frameIdx > newestIdx)
+            recentPoses[i].pose = recentPoses[i].pose * result.correction;
+    }
+
+    // the lookup table rows and the backprojected points are in the same order, both are updated by id
+    for (int i=0; i<updatedFrame.size(); i++)
+    {
+        Frame &frame = updatedFrame[i];
+        for (int k=0; k<frame._3dToDescriptor.size(); k++)
         {
-            for (int k=0; k<trackedFrame[j].matchedWorldPoints.size(); k++)
-            {
-                if (almostEqual(trackedFrame[j].matchedWorldPoints[k].x, points3D[i].x, FLT_THRESHOLD))
-                    if (almostEqual(trackedFrame[j].matchedWorldPoints[k].y, points3D[i].y, FLT_THRESHOLD))
-                        if (almostEqual(trackedFrame[j].matchedWorldPoints[k].z, points3D[i].z, FLT_THRESHOLD))
-                        {
-                            count++;
-                            visibility[j][i] = 1;
-                            pointsImg[j][i] = Point2d(trackedFrame[j].matchedImagePoints[k].x,trackedFrame[j].matchedImagePoints[k].y);
-                        }
-                        else
-                            continue;
-                    else
-                        continue;
-                else
-                    continue;
-            }
+            unordered_map<int, LandmarkRecord>::iterator it = landmarks.find(frame._3dToDescriptor.getId(k));
+            if (it == landmarks.end() || it->second.version != result.version)
+                continue;
+
+            frame._3dToDescriptor.setPosition(k, it->second.position);
+            if (k < frame.reprojectedWorldPoints.size() && k < frame.reprojectedIds.size() && frame.reprojectedIds[k] == it->first)
+                frame.reprojectedWorldPoints[k] = it->second.position;
         }
     }
-    cout << "  visible items: " << count << endl;
-    
-    // append camera matrix, R, t and distCoeffs
-    Mat rTemp;
-    for (int i=0; i<trackedFrame.size(); i++)
+
+    // only the landmarks still in the window are kept, the records would otherwise grow with every adjusted id
+    unordered_set<int> windowIds;
+    for (int i=0; i<updatedFrame.size(); i++)
     {
-        // convert from 3x3 matrix to Rodrigues rotation matrix
-        Rodrigues(trackedFrame[i].R, rTemp);
-    
-        R.push_back(rTemp);
-        T.push_back(trackedFrame[i].t);
-        cameraMatrix.push_back(trackedFrame[i].K);
-        distCoeffs.push_back((Mat1d(5,1) << 0, 0, 0, 0, 0));
+        const vector<int> &tableIds = updatedFrame[i]._3dToDescriptor.getIds();
+        windowIds.insert(updatedFrame[i].matchedIds.begin(), updatedFrame[i].matchedIds.end());
+        windowIds.insert(tableIds.begin(), tableIds.end());
+    }
+    for (unordered_map<int, LandmarkRecord>::iterator it = landmarks.begin(); it != landmarks.end(); )
+    {
+        if (windowIds.count(it->first) == 0)
+            it = landmarks.erase(it);
+        else
+            it++;
     }
 }
 
-void BundleAdjust::updateData(vector<Point3d> points3D, vector<Mat> R, vector<Mat> t, vector<Frame> &updatedFrame)
+// poses and points of the window with SparseBundleAdjuster, the oldest frame of the window is kept fixed
+double BundleAdjust::runNative(vector<Point3d> &points3D, const vector<Observation> &observations, vector<Mat> &R, vector<Mat> &T)
 {
-    int worldPointsCount=0;
-    for (int i=0; i<updatedFrame.size(); i++)
+    vector<Pose>    poses;
+    vector<Matx33d> K;
+    for (int i=0; i<trackedFrame.size(); i++)
     {
-        // update each frame inside window
-        
-        // update world points
-        int begin, end;
-        begin = worldPointsCount;
-        end   = worldPointsCount + updatedFrame[i].matchedWorldPoints.size();
-        std::vector<Point3d>   temp3d(&points3D[begin],&points3D[end]);
-        updatedFrame[i].matchedWorldPoints = temp3d;
-
-        updatedFrame[i].projectCameratoWorld();
-        
-        // update rotation and translation matrices
-        Mat R_33;
-        Rodrigues(R[i], R_33);
-        updatedFrame[i].R = R_33;
-        updatedFrame[i].t = t[i];
-        
-        // update camera pose (T)
-        updatedFrame[i].cameraPose.at<double>(0,0) = R_33.at<double>(0,0);
-        updatedFrame[i].cameraPose.at<double>(0,1) = R_33.at<double>(0,1);
-        updatedFrame[i].cameraPose.at<double>(0,2) = R_33.at<double>(0,2);
-
-        updatedFrame[i].cameraPose.at<double>(1,0) = R_33.at<double>(1,0);
-        updatedFrame[i].cameraPose.at<double>(1,1) = R_33.at<double>(1,1);
-        updatedFrame[i].cameraPose.at<double>(1,2) = R_33.at<double>(1,2);
-
-        updatedFrame[i].cameraPose.at<double>(2,0) = R_33.at<double>(2,0);
-        updatedFrame[i].cameraPose.at<double>(2,1) = R_33.at<double>(2,1);
-        updatedFrame[i].cameraPose.at<double>(2,2) = R_33.at<double>(2,2);
-
-        updatedFrame[i].cameraPose.at<double>(0,3) = t[i].at<double>(0);
-        updatedFrame[i].cameraPose.at<double>(1,3) = t[i].at<double>(1);
-        updatedFrame[i].cameraPose.at<double>(2,3) = t[i].at<double>(2);
+        Mat K64;
+        trackedFrame[i].K.convertTo(K64, CV_64F);
+        poses.push_back(Pose::fromRodrigues(R[i], T[i]));
+        K.push_back(Matx33d(K64.ptr<double>()));
     }
+
+    double repError = sparse.run(poses, K, points3D, observations);
+
+    for (int i=0; i<poses.size(); i++)
+    {
+        R[i] = poses[i].getRotationVector();
+        T[i] = poses[i].getTranslationVector();
+    }
+    return repError;
 }
 
-void BundleAdjust::run(vector<Frame> &windowedFrame)
+// adjusts trackedFrame, only touches the members that belong to the running adjustment
+void BundleAdjust::solve(BundleResult &result)
 {
-    TermCriteria                    criteria(CV_TERMCRIT_ITER + CV_TERMCRIT_EPS, 1000, 1e-10);
-    vector<Point3d>                 points3D;
+    vector<Observation>             observations;
     vector<vector<cv::Point2d> >    pointsImg;
     vector<vector<int> >            visibility;
     vector<Mat>                     cameraMatrix;
     vector<Mat>                     distCoeffs, R, T;
 
-    this->trackedFrame = windowedFrame;
-        
     // prepare the data for the bundle
-    prepareData(points3D, pointsImg, ref(visibility), ref(cameraMatrix), ref(R), ref(T), ref(distCoeffs));
+    prepareData(result.points3D, observations, pointsImg, ref(visibility), ref(cameraMatrix), ref(R), ref(T), ref(distCoeffs));
+    vector<Mat> R0 = R, T0 = T;
 
-    
     // run the sparse bundle adjustment for N-window size
-    double repError = sba.run(ref(points3D),
-                                  pointsImg,
-                                  visibility,
-                                  cameraMatrix,
-                              ref(R),
-                              ref(T),
-                                  distCoeffs);
-    
-    
+    if (backend == BA_BACKEND_NATIVE)
+        result.repError = runNative(result.points3D, observations, R, T);
+    else
+        result.repError = sba.run(ref(result.points3D),
+                                      pointsImg,
+                                      visibility,
+                                      cameraMatrix,
+                                  ref(R),
+                                  ref(T),
+                                      distCoeffs);
+
+    for (int i=0; i<trackedFrame.size(); i++)
+        result.frameIdx.push_back(trackedFrame[i].frameIdx);
+    result.R            = R;
+    result.T            = T;
+    result.pointIds     = pointIds;
+    result.pointIndices = pointIndices;
+
+    if (!R.empty())
+        result.correction = Pose::fromRodrigues(R0.back(), T0.back()).inverse() * Pose::fromRodrigues(R.back(), T.back());
+
+    cout << "  reprojection error after bundle adjustment: " << result.repError << endl;
+}
+
+// copies only what the adjustment reads from the window: the pose, K and the matched points with their ids.
+// the K data is shared, the tracking only replaces the Mat headers
+void BundleAdjust::snapshot(const RingBuffer<Frame> &windowedFrame)
+{
+    trackedFrame.assign(windowedFrame.size(), Frame());
+    for (int i=0; i<windowedFrame.size(); i++)
+    {
+        const Frame &frame = windowedFrame[i];
+        Frame &tracked     = trackedFrame[i];
+
+        tracked.frameIdx           = frame.frameIdx;
+        tracked.pose               = frame.pose;
+        tracked.K                  = frame.K;
+        tracked.matchedWorldPoints = frame.matchedWorldPoints;
+        tracked.matchedImagePoints = frame.matchedImagePoints;
+        tracked.matchedIds         = frame.matchedIds;
+    }
+}
+
+void BundleAdjust::run(RingBuffer<Frame> &windowedFrame, vector<TrackedPose> &recentPoses)
+{
+    // a background adjustment would race on the members, hand it back first
+    if (pending.valid())
+    {
+        pending.wait();
+        merge(windowedFrame, recentPoses);
+    }
+
+    BundleResult result;
+    result.version = ++version;
+    snapshot(windowedFrame);
+    solve(result);
+
     // do something to the trackedFrame
-    updateData(points3D, R, T, windowedFrame);
-    
-    cout << "  reprojection error after bundle adjustment: " << repError << endl;
+    updateData(result, windowedFrame, recentPoses);
+}
+
+bool BundleAdjust::runAsync(const RingBuffer<Frame> &windowedFrame)
+{
+    if (isRunning())
+        return false;
+
+    snapshot(windowedFrame);
+    int snapshotVersion = ++version;
+    pending = async(launch::async, [this, snapshotVersion]()
+    {
+        BundleResult result;
+        result.version = snapshotVersion;
+        solve(result);
+        return result;
+    });
+    return true;
+}
+
+bool BundleAdjust::merge(RingBuffer<Frame> &windowedFrame, vector<TrackedPose> &recentPoses)
+{
+    if (!pending.valid() || isRunning())
+        return false;
+
+    updateData(pending.get(), windowedFrame, recentPoses);
+    return true;
+}
+
+bool BundleAdjust::isRunning()
+{
+    return pending.valid() && pending.wait_for(chrono::seconds(0)) != future_status::ready;
 }
@@ -0,0 +1,106 @@
+#include "CameraModel.h"
+#include "Calibration.h"
+
+#include <iostream>
+#include <vector>
+
+#include <opencv2/opencv.hpp>
+#include <opencv2/core/core.hpp>
+
+using namespace std;
+using namespace cv;
+
+// constructor
+CameraModel::CameraModel()
+{
+    Calibration calib;
+    init(calib.getCameraMatrix(), calib.getDistortionCoeffs());
+}
+
+CameraModel::CameraModel(Mat cameraMatrix, Mat distCoeffs)
+{
+    init(cameraMatrix, distCoeffs);
+}
+
+// destructor
+CameraModel::~CameraModel()
+{
+    // do nothing
+}
+
+void CameraModel::init(Mat cameraMatrix, Mat distCoeffs)
+{
+    // keep own copies, the model must not change when the caller's matrices do
+    cameraMatrix.convertTo(this->cameraMatrix, CV_64F);
+    this->cameraMatrixInv = this->cameraMatrix.inv();
+    this->K               = Matx33d(this->cameraMatrix.ptr<double>());
+    this->Kinv            = Matx33d(this->cameraMatrixInv.ptr<double>());
+
+    this->fx = K(0,0);
+    this->fy = K(1,1);
+    this->cx = K(0,2);
+    this->cy = K(1,2);
+
+    this->distorted = !distCoeffs.empty() && (countNonZero(distCoeffs) != 0);
+    if (this->distorted)
+        distCoeffs.convertTo(this->distCoeffs, CV_64F);
+}
+
+Mat CameraModel::getCameraMatrix() const
+{
+    return cameraMatrix;
+}
+
+Mat CameraModel::getInverseCameraMatrix() const
+{
+    return cameraMatrixInv;
+}
+
+Mat CameraModel::getDistortionCoeffs() const
+{
+    return distCoeffs;
+}
+
+const Matx33d& CameraModel::getK() const
+{
+    return K;
+}
+
+const Matx33d& CameraModel::getKinv() const
+{
+    return Kinv;
+}
+
+bool CameraModel::hasDistortion() const
+{
+    return distorted;
+}
+
+void CameraModel::undistort(const vector<Point2d> &points, vector<Point2d> &undistorted) const
+{
+    if (!distorted || points.empty())
+        undistorted = points;
+    else
+        undistortPoints(points, undistorted, cameraMatrix, distCoeffs, noArray(), cameraMatrix);
+}
+
+CameraModel CameraModel::scaled(double factor) const
+{
+    // the distortion coefficients are defined on the normalized coordinates, they don't change with the resolution
+    return CameraModel(scaleCameraMatrix(cameraMatrix, factor), distCoeffs);
+}
+
+Mat CameraModel::scaleCameraMatrix(Mat cameraMatrix, double factor)
+{
+    Mat scaled;
+    cameraMatrix.convertTo(scaled, CV_64F);
+
+    // the focal lengths scale with the image, the principal point with the pixel centers (at +0.5)
+    scaled.at<double>(0, 0) *= factor;
+    scaled.at<double>(1, 1) *= factor;
+    scaled.at<double>(0, 1) *= factor;
+    scaled.at<double>(0, 2) = (scaled.at<double>(0, 2) + 0.5) * factor - 0.5;
+    scaled.at<double>(1, 2) = (scaled.at<double>(1, 2) + 0.5) * factor - 0.5;
+
+    return scaled;
+}
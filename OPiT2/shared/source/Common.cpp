@@ -6,6 +6,7 @@
 #include <chrono>
 #include <mutex>
 #include <thread>
+#include <atomic>
 #include <sys/stat.h>
 #include <vector>
 
@@ -27,6 +28,8 @@ using namespace std::chrono;
 using namespace cv;
 
 
+atomic<int> Common::landmarkCounter(0);
+
 // constructor
 Common::Common()
 {
@@ -165,24 +168,44 @@ void Common::readCsvTo3D2D(char *fileName, vector<Point3d> &worldPoints, vector<
     file.close();
 }
 
+/* ---------------------------------------------------------------------------------------------------------
+    landmark ids, given once when a landmark is created (map or backprojection) and kept while it is tracked
+   ---------------------------------------------------------------------------------------------------------*/
+int Common::newLandmarkId()
+{
+    return landmarkCounter++;
+}
+
+// reserve count consecutive ids, returns the first one
+int Common::newLandmarkIds(int count)
+{
+    return landmarkCounter.fetch_add(count);
+}
+
+// the ids below nextId are taken, e.g. by the landmarks of a loaded map
+void Common::reserveLandmarkIds(int nextId)
+{
+    int current = landmarkCounter.load();
+    while ((current < nextId) && !landmarkCounter.compare_exchange_weak(current, nextId));
+}
+
 /* ---------------------------------------------------------------------------------------------------------
     lookup table tools
    ---------------------------------------------------------------------------------------------------------*/
-void Common::updatelut (vector<Point3d> point3D, Mat descriptor, vector< pair<Point3d, Mat> > &lookuptable)
+void Common::updatelut (vector<Point3d> point3D, Mat descriptor, LandmarkTable &lookuptable)
 {
+    int firstId = newLandmarkIds(point3D.size());
+
+    vector<int> ids(point3D.size());
     for (int h = 0; h < point3D.size(); h++)
-	{
-		lookuptable.push_back(make_pair(point3D[h], descriptor.row(h)));
-	}
+        ids[h] = firstId + h;
+
+    lookuptable.append(point3D, descriptor, ids);
 }
 
-Mat Common::getdescriptor (vector< pair<Point3d, Mat> > lookuptable)
+Mat Common::getdescriptor (const LandmarkTable &lookuptable)
 {
-    Mat descriptorTemp;
-    for (pair<Point3d, Mat> pair : lookuptable)
-        descriptorTemp.push_back(pair.second);
-
-    return descriptorTemp;
+    return lookuptable.getDescriptors();
 }
 
 
@@ -190,13 +213,14 @@ Mat Common::getdescriptor (vector< pair<Point3d, Mat> > lookuptable)
     multithreading support for backprojection
    ---------------------------------------------------------------------------------------------------------*/
 
-void Common::calcBestPoint ( Mat T, Mat K, vector<KeyPoint> imagepoint, Mat descriptor,
+void Common::calcBestPoint ( Mat T, Mat K, vector<KeyPoint> imagepoint, Mat descriptor, vector<int> keypointIds,
                         pcl::PointCloud<pcl::PointXYZ>::Ptr& cloud, pcl::KdTreeFLANN<pcl::PointXYZ>& kdtree,
                         int start, int end, int tidx,
-                        vector<pair<Point3d, Mat> > &vocabulary,
+                        LandmarkTable &vocabulary,
                         vector<Point3d> &projected3D,
                         vector<Point2d> &projected2D,
-                        vector<int> &projectedIndex)
+                        vector<int> &projectedIndex,
+                        vector<int> &projectedIds)
 {
     vector <double> temp = {0,0,0,1000};
     Point3d _mp3dcoord;
@@ -206,12 +230,16 @@ void Common::calcBestPoint ( Mat T, Mat K, vector<KeyPoint> imagepoint, Mat desc
         _mp3dcoord.x = temp[0]; _mp3dcoord.y = temp[1]; _mp3dcoord.z = temp[2];
         if ((_mp3dcoord.x > 0.0f) && (_mp3dcoord.y > 0.0f) && (_mp3dcoord.z > 0.0f))
         {
+            // a keypoint matched to a tracked landmark continues its track, otherwise it starts a new one
+            int id = ((i < keypointIds.size()) && (keypointIds[i] >= 0)) ? keypointIds[i] : newLandmarkId();
+
             lock_guard<mutex> lock(g_mutex);
             {
                 projected2D.push_back(Point2d(imagepoint[i].pt.x,imagepoint[i].pt.y));
                 projected3D.push_back(_mp3dcoord);
                 projectedIndex.push_back(i);
-                vocabulary.push_back(make_pair(_mp3dcoord, descriptor.row(i)));
+                projectedIds.push_back(id);
+                vocabulary.append(_mp3dcoord, descriptor.row(i), id);
             }
         }
     }
@@ -219,16 +247,29 @@ void Common::calcBestPoint ( Mat T, Mat K, vector<KeyPoint> imagepoint, Mat desc
 
 void Common::threading( int numofthreads, Mat T, Mat K, vector<KeyPoint> detectedkpts, Mat descriptor,
                         pcl::PointCloud<pcl::PointXYZ>::Ptr& cloud, pcl::KdTreeFLANN<pcl::PointXYZ>& kdtree,
-                        vector<pair<Point3d, Mat> > &lookuptable, vector<Point3d> &tunnel3D, vector<Point2d> &tunnel2D, vector<int> &tunnel1D)
+                        LandmarkTable &lookuptable, vector<Point3d> &tunnel3D, vector<Point2d> &tunnel2D, vector<int> &tunnel1D)
+{
+    vector<int> tunnelIds;
+    threading(numofthreads, T, K, detectedkpts, descriptor, vector<int>(), cloud, kdtree, lookuptable, tunnel3D, tunnel2D, tunnel1D, tunnelIds);
+}
+
+void Common::threading( int numofthreads, Mat T, Mat K, vector<KeyPoint> detectedkpts, Mat descriptor, vector<int> keypointIds,
+                        pcl::PointCloud<pcl::PointXYZ>::Ptr& cloud, pcl::KdTreeFLANN<pcl::PointXYZ>& kdtree,
+                        LandmarkTable &lookuptable, vector<Point3d> &tunnel3D, vector<Point2d> &tunnel2D, vector<int> &tunnel1D,
+                        vector<int> &tunnelIds)
 {
     int numtask = floor(detectedkpts.size()/numofthreads);
+
+    // the arena is sized up front, the workers only copy their rows into it
+    lookuptable.reserve(lookuptable.size() + detectedkpts.size(), descriptor.cols, descriptor.type());
     for (int tidx = 0; tidx < numofthreads; tidx++)
     {
         int start = tidx    * numtask;
         int end   = (tidx+1)* numtask;
-        workers.push_back(thread(&Common::calcBestPoint,  this, T, K, detectedkpts, descriptor, std::ref(cloud), std::ref(kdtree),
+        workers.push_back(thread(&Common::calcBestPoint,  this, T, K, detectedkpts, descriptor, keypointIds, std::ref(cloud), std::ref(kdtree),
                                                                 start, end, tidx,
-                                                                std::ref(lookuptable), std::ref(tunnel3D), std::ref(tunnel2D), std::ref(tunnel1D)));
+                                                                std::ref(lookuptable), std::ref(tunnel3D), std::ref(tunnel2D), std::ref(tunnel1D),
+                                                                std::ref(tunnelIds)));
     }
     for (int tidx = 0; tidx < numofthreads; tidx ++) {workers[tidx].join();} workers.clear();
 }
@@ -0,0 +1,433 @@
+#include "DescriptorStore.h"
+#include "BinaryDescriptor.h"
+
+#include <iostream>
+#include <fstream>
+#include <algorithm>
+#include <cmath>
+#include <string>
+#include <vector>
+
+#include <opencv2/opencv.hpp>
+#include <opencv2/core/core.hpp>
+
+using namespace std;
+using namespace cv;
+
+/*
+    A compressed descriptor store for the tunnel map, based on
+
+        H. Jegou, M. Douze and C. Schmid, "Product Quantization for Nearest Neighbor Search", TPAMI 2011
+        T. Ge, K. He, Q. Ke and J. Sun, "Optimized Product Quantization", TPAMI 2014
+
+    a 128-float SIFT descriptor (512 bytes) is rotated by R, splitted into M subspaces and every subspace is replaced by
+    the index of its closest centroid, so a landmark only needs M bytes in memory (16 or 32). the distance between a query
+    and an encoded descriptor is approximated with a lookup table of M*Ks subspace distances (asymmetric distance), and the
+    best candidates are re-ranked with the full-precision descriptors kept on disk.
+*/
+
+// squared L2 distance between two sub-vectors
+static inline float distanceL2Sqr(const float *a, const float *b, int n)
+{
+    float sum = 0;
+    for (int i=0; i<n; i++)
+    {
+        float d = a[i] - b[i];
+        sum += d*d;
+    }
+    return sum;
+}
+
+// constructor
+DescriptorStore::DescriptorStore()
+{
+    this->numOfSubspaces   = 16;
+    this->numOfCentroids   = 256;
+    this->paramCentroids   = 256;
+    this->dims             = 0;
+    this->subDims          = 0;
+    this->numOfDescriptors = 0;
+}
+
+DescriptorStore::DescriptorStore(int numOfSubspaces, int numOfCentroids)
+{
+    this->numOfSubspaces   = numOfSubspaces;
+    this->numOfCentroids   = min(numOfCentroids, 256);
+    this->paramCentroids   = this->numOfCentroids;
+    this->dims             = 0;
+    this->subDims          = 0;
+    this->numOfDescriptors = 0;
+}
+
+// destructor
+DescriptorStore::~DescriptorStore()
+{
+    if (rawFile.is_open())
+        rawFile.close();
+}
+
+/* ---------------------------------------------------------------------------------------------------------
+    offline training and persistence
+   ---------------------------------------------------------------------------------------------------------*/
+void DescriptorStore::train(Mat descriptors, int opqIterations)
+{
+    Mat raw, X;
+    toFloatDescriptors(descriptors, raw);
+
+    dims           = raw.cols;
+    subDims        = (dims + numOfSubspaces - 1) / numOfSubspaces;
+    numOfCentroids = min(paramCentroids, raw.rows);
+    rotation       = Mat::eye(numOfSubspaces * subDims, numOfSubspaces * subDims, CV_32F);
+    pad(raw, X);
+
+    // non-parametric OPQ, alternate between the codebooks and the rotation (orthogonal procrustes)
+    for (int it=0; it<opqIterations; it++)
+    {
+        Mat Xr = X * rotation;
+        trainCodebooks(Xr, 4);
+
+        Mat Y = Mat::zeros(X.rows, X.cols, CV_32F);
+        vector<uchar> code(numOfSubspaces);
+        for (int i=0; i<X.rows; i++)
+        {
+            encode(Xr.ptr<float>(i), code.data());
+            decode(code.data(), Y.ptr<float>(i));
+        }
+
+        // R = U * V^t, where X^t * Y = U * S * V^t
+        Mat W, U, Vt;
+        SVD::compute(X.t() * Y, W, U, Vt);
+        rotation = U * Vt;
+    }
+
+    trainCodebooks(X * rotation, 20);
+
+    // the codes of a different codebook are meaningless
+    encodeStored();
+}
+
+// a descriptor length that isn't a multiple of M (e.g. 488-bit AKAZE into 16 subspaces) is zero padded to M*subDims
+void DescriptorStore::pad(const Mat &descriptors, Mat &padded)
+{
+    if (descriptors.cols == numOfSubspaces * subDims)
+    {
+        padded = descriptors;
+        return;
+    }
+
+    padded = Mat::zeros(descriptors.rows, numOfSubspaces * subDims, CV_32F);
+    descriptors.copyTo(padded.colRange(0, descriptors.cols));
+}
+
+void DescriptorStore::trainCodebooks(Mat data, int iterations)
+{
+    codebooks.create(numOfSubspaces * numOfCentroids, subDims, CV_32F);
+
+    for (int m=0; m<numOfSubspaces; m++)
+    {
+        Mat subspace = data.colRange(m*subDims, (m+1)*subDims).clone();
+        Mat labels, centers;
+
+        kmeans(subspace, numOfCentroids, labels,
+               TermCriteria(TermCriteria::EPS + TermCriteria::COUNT, iterations, 1e-4),
+               1, KMEANS_PP_CENTERS, centers);
+
+        centers.copyTo(codebooks.rowRange(m*numOfCentroids, (m+1)*numOfCentroids));
+    }
+}
+
+bool DescriptorStore::save(string filename)
+{
+    FileStorage storage(filename, FileStorage::WRITE);
+    if (!storage.isOpened())
+        return false;
+
+    storage << "numOfSubspaces" << numOfSubspaces;
+    storage << "numOfCentroids" << numOfCentroids;
+    storage << "dims"           << dims;
+    storage << "rotation"       << rotation;
+    storage << "codebooks"      << codebooks;
+
+    // the map stored so far, its raw descriptors are in the raw file and the codes of the trained store are kept here
+    storage << "numOfDescriptors" << numOfDescriptors;
+    if (!empty())
+        storage << "codes" << Mat(numOfDescriptors, numOfSubspaces, CV_8U, codes.data());
+    storage.release();
+
+    return true;
+}
+
+bool DescriptorStore::load(string filename)
+{
+    FileStorage storage(filename, FileStorage::READ);
+    if (!storage.isOpened())
+        return false;
+
+    storage["numOfSubspaces"] >> numOfSubspaces;
+    storage["numOfCentroids"] >> numOfCentroids;
+    storage["dims"]           >> dims;
+    storage["rotation"]       >> rotation;
+    storage["codebooks"]      >> codebooks;
+
+    Mat storedCodes;
+    storage["numOfDescriptors"] >> numOfDescriptors;
+    storage["codes"]            >> storedCodes;
+    storage.release();
+
+    subDims = (numOfSubspaces > 0) ? (dims + numOfSubspaces - 1) / numOfSubspaces : 0;
+
+    // the stored map needs its raw descriptors, a missing or shorter raw file starts the map over
+    streamoff rawSize = 0;
+    if (rawFile.is_open())
+    {
+        rawFile.seekg(0, ios::end);
+        rawSize = rawFile.tellg();
+    }
+    if ((streamoff)numOfDescriptors * dims * sizeof(float) > rawSize)
+    {
+        cerr << "the raw file holds less than the " << numOfDescriptors << " stored descriptors, starting the map over" << endl;
+        numOfDescriptors = 0;
+    }
+
+    // older stores without their codes are encoded again from the raw file
+    if (!empty() && (storedCodes.rows == numOfDescriptors) && (storedCodes.cols == numOfSubspaces) && storedCodes.isContinuous())
+        codes.assign(storedCodes.data, storedCodes.data + numOfDescriptors * numOfSubspaces);
+    else
+        encodeStored();
+
+    return !empty();
+}
+
+bool DescriptorStore::empty()
+{
+    return codebooks.empty();
+}
+
+bool DescriptorStore::open(string rawFilename)
+{
+    if (rawFile.is_open())
+        rawFile.close();
+
+    // the raw file of the map from earlier runs is kept, it is created on the first run
+    rawFile.open(rawFilename, ios::in | ios::out | ios::binary);
+    if (!rawFile.is_open())
+        rawFile.open(rawFilename, ios::in | ios::out | ios::binary | ios::trunc);
+
+    return rawFile.is_open();
+}
+
+/* ---------------------------------------------------------------------------------------------------------
+    encoding, storage and search
+   ---------------------------------------------------------------------------------------------------------*/
+void DescriptorStore::encode(const float *rotated, uchar *code)
+{
+    for (int m=0; m<numOfSubspaces; m++)
+    {
+        const float *sub = rotated + m*subDims;
+        int   best     = 0;
+        float bestDist = distanceL2Sqr(sub, codebooks.ptr<float>(m*numOfCentroids), subDims);
+
+        for (int c=1; c<numOfCentroids; c++)
+        {
+            float dist = distanceL2Sqr(sub, codebooks.ptr<float>(m*numOfCentroids + c), subDims);
+            if (dist < bestDist)
+            {
+                bestDist = dist;
+                best     = c;
+            }
+        }
+        code[m] = (uchar)best;
+    }
+}
+
+void DescriptorStore::decode(const uchar *code, float *rotated)
+{
+    for (int m=0; m<numOfSubspaces; m++)
+    {
+        const float *centroid = codebooks.ptr<float>(m*numOfCentroids + code[m]);
+        std::copy(centroid, centroid + subDims, rotated + m*subDims);
+    }
+}
+
+void DescriptorStore::computeDistanceTable(const float *rotated, float *table)
+{
+    for (int m=0; m<numOfSubspaces; m++)
+        for (int c=0; c<numOfCentroids; c++)
+            table[m*numOfCentroids + c] = distanceL2Sqr(rotated + m*subDims, codebooks.ptr<float>(m*numOfCentroids + c), subDims);
+}
+
+void DescriptorStore::encodeStored()
+{
+    codes.assign(numOfDescriptors * numOfSubspaces, 0);
+    if (empty() || (numOfDescriptors == 0))
+        return;
+
+    // in chunks, the raw file can be much larger than the memory of the codes
+    const int CHUNK = 10000;
+    for (int first=0; first<numOfDescriptors; first+=CHUNK)
+    {
+        vector<int> indices;
+        for (int i=first; i<min(first + CHUNK, numOfDescriptors); i++)
+            indices.push_back(i);
+
+        Mat X, Xp;
+        getDescriptors(indices, X);
+        pad(X, Xp);
+        Mat Xr = Xp * rotation;
+        for (int i=0; i<Xr.rows; i++)
+            encode(Xr.ptr<float>(i), &codes[(first + i) * numOfSubspaces]);
+    }
+}
+
+int DescriptorStore::add(Mat descriptors)
+{
+    int first = numOfDescriptors;
+    if (descriptors.empty())
+        return first;
+
+    Mat X;
+    toFloatDescriptors(descriptors, X);
+    if (dims == 0)
+        dims = X.cols;
+
+    // after the stored rows, whatever an unsaved run left behind is overwritten
+    rawFile.clear();
+    rawFile.seekp((streamoff)numOfDescriptors * dims * sizeof(float), ios::beg);
+    for (int i=0; i<X.rows; i++)
+        rawFile.write((const char *)X.ptr<float>(i), dims * sizeof(float));
+    rawFile.flush();
+
+    // only the raw descriptors until the codebooks are trained
+    if (!empty())
+    {
+        Mat Xp;
+        pad(X, Xp);
+        Mat Xr = Xp * rotation;
+
+        codes.resize((numOfDescriptors + X.rows) * numOfSubspaces);
+        for (int i=0; i<X.rows; i++)
+            encode(Xr.ptr<float>(i), &codes[(numOfDescriptors + i) * numOfSubspaces]);
+    }
+
+    numOfDescriptors += X.rows;
+    return first;
+}
+
+int DescriptorStore::size()
+{
+    return numOfDescriptors;
+}
+
+int DescriptorStore::getCodeSize()
+{
+    return numOfSubspaces;
+}
+
+void DescriptorStore::getDescriptors(const vector<int> &indices, Mat &descriptors)
+{
+    descriptors.create(indices.size(), dims, CV_32F);
+    rawFile.clear();
+
+    // consecutive indices (a segment, a sorted shortlist) are read in one go
+    for (int i=0, run=1; i<indices.size(); i+=run)
+    {
+        for (run=1; (i+run < indices.size()) && (indices[i+run] == indices[i] + run); run++);
+
+        rawFile.seekg((streamoff)indices[i] * dims * sizeof(float), ios::beg);
+        rawFile.read((char *)descriptors.ptr<float>(i), (streamsize)run * dims * sizeof(float));
+    }
+}
+
+void DescriptorStore::knnSearch(Mat queryDescriptors, const vector<int> &candidates, int k, int rerank, vector<vector<DMatch> > &matches)
+{
+    matches.clear();
+    if (candidates.size() < k)
+        return;
+
+    Mat Q;
+    toFloatDescriptors(queryDescriptors, Q);
+
+    // the squared L2 distance of unpacked bits is the hamming distance, which the ratio test of the binary matchers sees.
+    // the float descriptors get their L2 distance as with NORM_L2
+    bool binary = isBinaryDescriptor(queryDescriptors);
+
+    // without codebooks an exact search, the candidates are read from disk once and matched in memory
+    if (empty())
+    {
+        Mat C;
+        getDescriptors(candidates, C);
+
+        vector<vector<DMatch> > knn;
+        BFMatcher(binary ? NORM_L2SQR : NORM_L2).knnMatch(Q, C, knn, k);
+        for (int q=0; q<knn.size(); q++)
+        {
+            for (int r=0; r<knn[q].size(); r++)
+                swap(knn[q][r].queryIdx, knn[q][r].trainIdx);
+            matches.push_back(knn[q]);
+        }
+        return;
+    }
+
+    Mat Qp, Qr;
+    pad(Q, Qp);
+    Qr = Qp * rotation;
+
+    rerank = max(k, min(rerank, (int)candidates.size()));
+
+    vector<float>            table(numOfSubspaces * numOfCentroids);
+    vector<pair<float, int> > approx(candidates.size());
+    vector<int>              shortlist(Q.rows * rerank);       // size QxR, the best candidates of every query (position inside candidates)
+
+    for (int q=0; q<Q.rows; q++)
+    {
+        computeDistanceTable(Qr.ptr<float>(q), table.data());
+
+        // asymmetric distance, sum of M table lookups per candidate
+        for (int i=0; i<candidates.size(); i++)
+        {
+            const uchar *code = &codes[candidates[i] * numOfSubspaces];
+            float dist = 0;
+            for (int m=0; m<numOfSubspaces; m++)
+                dist += table[m*numOfCentroids + code[m]];
+            approx[i] = make_pair(dist, i);
+        }
+        nth_element(approx.begin(), approx.begin() + (rerank-1), approx.end());
+
+        for (int r=0; r<rerank; r++)
+            shortlist[q*rerank + r] = approx[r].second;
+    }
+
+    // the queries share many of their best candidates, every one of them is read from disk once
+    vector<int> reranked(shortlist);
+    sort(reranked.begin(), reranked.end());
+    reranked.erase(unique(reranked.begin(), reranked.end()), reranked.end());
+
+    vector<int> rows(candidates.size(), -1);
+    vector<int> indices(reranked.size());
+    for (int j=0; j<reranked.size(); j++)
+    {
+        rows[reranked[j]] = j;
+        indices[j]        = candidates[reranked[j]];
+    }
+
+    Mat raw;
+    getDescriptors(indices, raw);
+
+    // exact re-ranking with the full-precision descriptors
+    vector<pair<float, int> > exact(rerank);
+    for (int q=0; q<Q.rows; q++)
+    {
+        for (int r=0; r<rerank; r++)
+        {
+            int i = shortlist[q*rerank + r];
+            float dist = distanceL2Sqr(Q.ptr<float>(q), raw.ptr<float>(rows[i]), dims);
+            exact[r] = make_pair(binary ? dist : sqrt(dist), i);
+        }
+        partial_sort(exact.begin(), exact.begin() + k, exact.end());
+
+        vector<DMatch> knn;
+        for (int r=0; r<k; r++)
+            knn.push_back(DMatch(exact[r].second, q, exact[r].first));
+        matches.push_back(knn);
+    }
+}
@@ -1,5 +1,6 @@
 #include "Frame.h"
 #include "FeatureDetection.h"
+#include "BinaryDescriptor.h"
 
 #include <opencv2/core/core.hpp>
 #include <opencv2/highgui/highgui.hpp>
@@ -13,6 +14,9 @@
 #include <iostream>
 #include <thread>
 #include <iomanip>
+#include <algorithm>
+#include <numeric>
+#include <cfloat>
 
 #define IMG_ENTRANCE    433
 #define IMG_EARLY       503
@@ -40,6 +44,26 @@ FeatureDetection::FeatureDetection()
 	// sift
 	sift_matching_ratio = 0.8;
 
+	// tiling, 4x3 tiles of 320x320 for the 1280x960 frames
+	tile_cols = 4;
+	tile_rows = 3;
+	tile_overlap = 32;
+	tile_budget = 300;
+
+	// resolution, the base octave of OpenCV SIFT is the input upsampled by 2
+	feature_scale = 2.0;
+	refine_subpixel = false;
+
+	// selection, no budget
+	select_cols = 8;
+	select_rows = 6;
+	select_budget = 0;
+	cell_tries.assign(select_cols * select_rows, 0.0);
+	cell_hits.assign(select_cols * select_rows, 0.0);
+
+	// descriptors for every keypoint up front
+	lazy_descriptors = false;
+
 	//detector
 	fastdetect_ = FastFeatureDetector::create(
 		10,			// int		threshold on difference between intensity of the central pixel and pixels of a circle around this pixel.
@@ -66,6 +90,10 @@ FeatureDetection::FeatureDetection()
 
 	//matcher
 	matcher_ 	 = cv::BFMatcher::create("BruteForce");
+
+	// SIFT for the localization
+	feature_type = FEATURE_SIFT;
+	feature_	 = siftdetect_;
 }
 
 
@@ -85,6 +113,67 @@ void FeatureDetection::setSiftParam(int octave, double contrastThreshold, double
 
 	// reupdate the SIFT
 	siftdetect_ = cv::xfeatures2d::SIFT::create(0, octave_layer, contrast_threshold, edge_threshold, sigma);
+	if (feature_type == FEATURE_SIFT)
+		feature_ = siftdetect_;
+}
+
+void FeatureDetection::setFeatureType(int type)
+{
+	this->feature_type = type;
+	this->feature_     = createFeature(0);
+
+	// the knn matcher of the ratio test, the mutual matcher picks its distance from the descriptors
+	matcher_ = cv::BFMatcher::create(type == FEATURE_SIFT ? "BruteForce" : "BruteForce-Hamming");
+}
+
+int FeatureDetection::getFeatureType()
+{
+	return feature_type;
+}
+
+Ptr<Feature2D> FeatureDetection::createFeature(int budget)
+{
+	switch (feature_type)
+	{
+	case FEATURE_ORB:
+		// the keypoint selection bounds the number of keypoints, ORB only keeps the strongest of the budget
+		return ORB::create(budget > 0 ? budget : 10000);
+	case FEATURE_AKAZE:
+		// no budget, the caller keeps the strongest keypoints
+		return AKAZE::create();
+	default:
+		return xfeatures2d::SIFT::create(budget, octave_layer, contrast_threshold, edge_threshold, sigma);
+	}
+}
+
+void FeatureDetection::setTileParam(int tilesX, int tilesY, int overlap, int budget)
+{
+	this->tile_cols		= tilesX;
+	this->tile_rows		= tilesY;
+	this->tile_overlap	= overlap;
+	this->tile_budget	= budget;
+}
+
+void FeatureDetection::setScaleParam(double scale, bool refine)
+{
+	this->feature_scale		= scale;
+	this->refine_subpixel	= refine;
+}
+
+void FeatureDetection::setLazyDescriptors(bool lazy)
+{
+	this->lazy_descriptors = lazy;
+}
+
+void FeatureDetection::setSelectionParam(int gridX, int gridY, int budget)
+{
+	this->select_cols		= gridX;
+	this->select_rows		= gridY;
+	this->select_budget		= budget;
+
+	// the learned rates belong to the old grid
+	cell_tries.assign(select_cols * select_rows, 0.0);
+	cell_hits.assign(select_cols * select_rows, 0.0);
 }
 
 void FeatureDetection::computeKeypointsAndDraw(char *pathname)
@@ -224,18 +313,459 @@ void FeatureDetection::siftDetector(cv::Mat img, std::vector<cv::KeyPoint> &dete
     siftdetect_->detect(img, detectedPoints, mask);
 }
 
-void FeatureDetection::surfExtraction(cv::Mat img, std::vector<cv::KeyPoint> detectedPoints, cv::Mat &descriptor)
+void FeatureDetection::surfExtraction(cv::Mat img, std::vector<cv::KeyPoint> &detectedPoints, cv::Mat &descriptor)
 {
     // extract descriptor from keypoints using surf
     surfdetect_->compute(img, detectedPoints, descriptor);
 }
 
-void FeatureDetection::siftExtraction (cv::Mat img, std::vector<cv::KeyPoint> detectedPoints, cv::Mat &descriptor)
+void FeatureDetection::siftExtraction (cv::Mat img, std::vector<cv::KeyPoint> &detectedPoints, cv::Mat &descriptor)
 {
     // extract descriptor from keypoints using sift
     siftdetect_->compute(img, detectedPoints, descriptor);
 }
 
+void FeatureDetection::siftDetectAndCompute (cv::Mat img, cv::Mat mask, std::vector<cv::KeyPoint> &detectedPoints, cv::Mat &descriptor)
+{
+    // one gaussian/DoG pyramid for both the detection and the descriptors
+    siftdetect_->detectAndCompute(img, mask, detectedPoints, descriptor);
+}
+
+/* ---------------------------------------------------------------------------------------------------------
+    tiled SIFT. every tile runs detection and description on its area grown by the overlap (the support of the
+    descriptors near the border), but its mask only lets through the keypoints inside the tile itself
+   ---------------------------------------------------------------------------------------------------------*/
+class SiftTileBody : public ParallelLoopBody
+{
+public:
+	SiftTileBody(const Mat &img, const Mat &mask, const vector<Rect> &tiles, int overlap, int budget,
+				 const vector<Ptr<Feature2D> > &features, bool retain,
+				 vector<vector<KeyPoint> > &keypoints, vector<Mat> &descriptors, bool describe)
+		: img(img), mask(mask), tiles(tiles), overlap(overlap), budget(budget), features(features), retain(retain),
+		  keypoints(keypoints), descriptors(descriptors), describe(describe) {}
+
+	void operator()(const Range &range) const
+	{
+		for (int i = range.start; i < range.end; i++)
+		{
+			Rect tile = tiles[i];
+			Rect area = Rect(tile.x - overlap, tile.y - overlap, tile.width + 2*overlap, tile.height + 2*overlap)
+					  & Rect(0, 0, img.cols, img.rows);
+
+			Mat tileMask = Mat::zeros(area.size(), CV_8U);
+			tileMask(tile - area.tl()) = Scalar(255);
+			if (!mask.empty())
+				bitwise_and(tileMask, mask(area), tileMask);
+
+			// e.g. the dashboard
+			if (countNonZero(tileMask) == 0)
+				continue;
+
+			// one detector per tile, the budget keeps the strongest keypoints of the tile. a detector without
+			// a budget (retain) has them filtered before the description, a budget of 0 keeps all of them
+			if (describe && !retain)
+				features[i]->detectAndCompute(img(area), tileMask, keypoints[i], descriptors[i]);
+			else
+			{
+				features[i]->detect(img(area), keypoints[i], tileMask);
+				if (retain && (budget > 0))
+					KeyPointsFilter::retainBest(keypoints[i], budget);
+				if (describe)
+					features[i]->compute(img(area), keypoints[i], descriptors[i]);
+			}
+
+			Point2f offset((float)area.x, (float)area.y);
+			for (int k = 0; k < keypoints[i].size(); k++)
+				keypoints[i][k].pt += offset;
+		}
+	}
+
+private:
+	const Mat &img;
+	const Mat &mask;
+	const vector<Rect> &tiles;
+	int overlap;
+	int budget;
+	const vector<Ptr<Feature2D> > &features;
+	bool retain;
+	vector<vector<KeyPoint> > &keypoints;
+	vector<Mat> &descriptors;
+	bool describe;
+};
+
+void FeatureDetection::siftTiledExtraction (cv::Mat img, cv::Mat mask, std::vector<cv::KeyPoint> &detectedPoints, cv::Mat &descriptor, bool describe)
+{
+	vector<Rect> tiles;
+	for (int r = 0; r < tile_rows; r++)
+	{
+		for (int c = 0; c < tile_cols; c++)
+		{
+			int x0 = c * img.cols / tile_cols, x1 = (c+1) * img.cols / tile_cols;
+			int y0 = r * img.rows / tile_rows, y1 = (r+1) * img.rows / tile_rows;
+			tiles.push_back(Rect(x0, y0, x1 - x0, y1 - y0));
+		}
+	}
+
+	vector<vector<KeyPoint> > tileKeypoints(tiles.size());
+	vector<Mat> tileDescriptors(tiles.size());
+	vector<Ptr<Feature2D> > features(tiles.size());
+	for (int i = 0; i < tiles.size(); i++)
+		features[i] = createFeature(tile_budget);
+
+	parallel_for_(Range(0, tiles.size()), SiftTileBody(img, mask, tiles, tile_overlap, tile_budget,
+													   features, feature_type == FEATURE_AKAZE,
+													   tileKeypoints, tileDescriptors, describe));
+
+	// merge in tile order, so the result doesn't depend on the scheduling. the output buffers are reused
+	// when they already have the right size
+	int total = 0, cols = 0, type = CV_32F;
+	for (int i = 0; i < tiles.size(); i++)
+	{
+		total += tileKeypoints[i].size();
+		if (!tileDescriptors[i].empty())
+		{
+			cols = tileDescriptors[i].cols;
+			type = tileDescriptors[i].type();
+		}
+	}
+
+	detectedPoints.clear();
+	detectedPoints.reserve(total);
+	if (total == 0 || !describe)
+	{
+		for (int i = 0; i < tiles.size(); i++)
+			detectedPoints.insert(detectedPoints.end(), tileKeypoints[i].begin(), tileKeypoints[i].end());
+		descriptor.release();
+		return;
+	}
+
+	descriptor.create(total, cols, type);
+	for (int i = 0, row = 0; i < tiles.size(); i++)
+	{
+		detectedPoints.insert(detectedPoints.end(), tileKeypoints[i].begin(), tileKeypoints[i].end());
+		if (tileKeypoints[i].empty())
+			continue;
+		tileDescriptors[i].copyTo(descriptor.rowRange(row, row + tileDescriptors[i].rows));
+		row += tileDescriptors[i].rows;
+	}
+}
+
+void FeatureDetection::extractFeatures (cv::Mat img, cv::Mat mask, Frame &frame)
+{
+	// OpenCV SIFT always builds its base octave from the input upsampled by 2, so a smaller base octave needs a smaller input.
+	// ORB and AKAZE start at the input resolution
+	double base = (feature_type == FEATURE_SIFT) ? 2.0 : 1.0;
+	double factor = std::min(feature_scale / base, 1.0);
+
+	Mat input = img, inputMask = mask;
+	if (factor < 1.0)
+	{
+		resize(img, input, Size(), factor, factor, INTER_AREA);
+		if (!mask.empty())
+			resize(mask, inputMask, input.size(), 0, 0, INTER_NEAREST);
+	}
+
+	// the lazy mode only detects, the descriptors are computed on the feature image when they are needed
+	if (tile_cols * tile_rows > 1)
+		siftTiledExtraction(input, inputMask, frame.keypoints, frame.descriptors, !lazy_descriptors);
+	else if (lazy_descriptors)
+	{
+		feature_->detect(input, frame.keypoints, inputMask);
+		frame.descriptors.release();
+	}
+	else
+		feature_->detectAndCompute(input, inputMask, frame.keypoints, frame.descriptors);
+
+	if (factor < 1.0)
+	{
+		// back to the coordinates of img, the pixel centers are at +0.5
+		for (int i = 0; i < frame.keypoints.size(); i++)
+		{
+			KeyPoint &kp = frame.keypoints[i];
+			kp.pt	= (kp.pt + Point2f(0.5f, 0.5f)) * (float)(1.0 / factor) - Point2f(0.5f, 0.5f);
+			kp.size	= kp.size / (float)factor;
+		}
+
+		if (refine_subpixel)
+			refineKeypoints(img, frame.keypoints, (int)ceil(1.0 / factor));
+	}
+
+	// bounded number of keypoints for the backprojection, matching and pnp
+	selectKeypoints(frame.keypoints, frame.descriptors, img.size());
+
+	frame.keypointIds.assign(frame.keypoints.size(), -1);
+	if (lazy_descriptors)
+	{
+		frame.featureImage = input;
+		frame.featureScale = factor;
+		frame.descriptors  = Mat::zeros(frame.keypoints.size(), feature_->descriptorSize(), feature_->descriptorType());
+		frame.described.assign(frame.keypoints.size(), 0);
+	}
+	else
+	{
+		frame.featureImage.release();
+		frame.described.assign(frame.keypoints.size(), 1);
+	}
+}
+
+int FeatureDetection::describeKeypoints (Frame &frame, const std::vector<int> &indices)
+{
+	// the keypoints without a descriptor yet, back in the coordinates of the feature image.
+	// the class id is the position inside missing, compute() drops keypoints (ORB and AKAZE near the border) and ORB regroups them by level
+	vector<int> missing;
+	vector<KeyPoint> subset;
+	for (int i = 0; i < indices.size(); i++)
+	{
+		int idx = indices[i];
+		if (frame.described[idx])
+			continue;
+
+		KeyPoint kp = frame.keypoints[idx];
+		kp.pt	= (kp.pt + Point2f(0.5f, 0.5f)) * (float)frame.featureScale - Point2f(0.5f, 0.5f);
+		kp.size	= kp.size * (float)frame.featureScale;
+		kp.class_id = missing.size();
+		missing.push_back(idx);
+		subset.push_back(kp);
+	}
+
+	if (missing.empty())
+		return 0;
+
+	// SIFT keeps every provided keypoint and only builds the octaves between the lowest and highest one of the subset
+	Mat descriptor;
+	if (!frame.featureImage.empty())
+		feature_->compute(frame.featureImage, subset, descriptor);
+
+	if (descriptor.rows != subset.size())
+	{
+		cerr << "failed to describe " << missing.size() << " keypoints of frame " << frame.frameIdx << endl;
+		return 0;
+	}
+
+	// the dropped keypoints can't be described on this image, they are not tried again and stay out of the matching
+	for (int i = 0; i < missing.size(); i++)
+		frame.described[missing[i]] = 2;
+
+	int count = 0;
+	for (int i = 0; i < subset.size(); i++)
+	{
+		int j = subset[i].class_id;
+		if ((j < 0) || (j >= missing.size()))
+			continue;
+
+		descriptor.row(i).copyTo(frame.descriptors.row(missing[j]));
+		frame.described[missing[j]] = 1;
+		count++;
+	}
+
+	if (count != missing.size())
+		cerr << "dropped " << missing.size() - count << " of " << missing.size() << " keypoints of frame " << frame.frameIdx << " while describing" << endl;
+
+	return count;
+}
+
+int FeatureDetection::describeKeypoints (Frame &frame)
+{
+	vector<int> all(frame.keypoints.size());
+	iota(all.begin(), all.end(), 0);
+	return describeKeypoints(frame, all);
+}
+
+void FeatureDetection::candidateKeypoints (const std::vector<cv::KeyPoint> &keypoints, const std::vector<cv::Point2d> &predicted,
+										   double radius, std::vector<int> &indices)
+{
+	indices.clear();
+	if (keypoints.empty())
+		return;
+
+	// the keypoints hashed into bins of the radius, a prediction only looks at the 3x3 bins around it
+	float minX = FLT_MAX, minY = FLT_MAX, maxX = -FLT_MAX, maxY = -FLT_MAX;
+	for (int i = 0; i < keypoints.size(); i++)
+	{
+		minX = std::min(minX, keypoints[i].pt.x); maxX = std::max(maxX, keypoints[i].pt.x);
+		minY = std::min(minY, keypoints[i].pt.y); maxY = std::max(maxY, keypoints[i].pt.y);
+	}
+
+	int binCols = (int)((maxX - minX) / radius) + 1;
+	int binRows = (int)((maxY - minY) / radius) + 1;
+	vector<vector<int> > bins(binCols * binRows);
+	for (int i = 0; i < keypoints.size(); i++)
+	{
+		int bx = (int)((keypoints[i].pt.x - minX) / radius);
+		int by = (int)((keypoints[i].pt.y - minY) / radius);
+		bins[by * binCols + bx].push_back(i);
+	}
+
+	vector<uchar> taken(keypoints.size(), 0);
+	for (int p = 0; p < predicted.size(); p++)
+	{
+		int bx = (int)floor((predicted[p].x - minX) / radius);
+		int by = (int)floor((predicted[p].y - minY) / radius);
+		if (bx < -1 || by < -1 || bx > binCols || by > binRows)
+			continue;
+
+		for (int y = std::max(by - 1, 0); y <= std::min(by + 1, binRows - 1); y++)
+			for (int x = std::max(bx - 1, 0); x <= std::min(bx + 1, binCols - 1); x++)
+				for (int j = 0; j < bins[y * binCols + x].size(); j++)
+				{
+					int i = bins[y * binCols + x][j];
+					double dx = keypoints[i].pt.x - predicted[p].x, dy = keypoints[i].pt.y - predicted[p].y;
+					if (dx*dx + dy*dy < radius*radius)
+						taken[i] = 1;
+				}
+	}
+
+	for (int i = 0; i < keypoints.size(); i++)
+		if (taken[i])
+			indices.push_back(i);
+}
+
+int FeatureDetection::gridCell (const cv::Point2f &pt)
+{
+	int cx = std::min(std::max((int)(pt.x * select_cols / select_size.width), 0), select_cols - 1);
+	int cy = std::min(std::max((int)(pt.y * select_rows / select_size.height), 0), select_rows - 1);
+	return cy * select_cols + cx;
+}
+
+/* ---------------------------------------------------------------------------------------------------------
+	keypoint selection. the keypoints are visited from the best score down, a keypoint is taken if its cell is
+	not full and no taken keypoint is closer than the suppression radius. the radius is the one of an even
+	spread of the budget over the image, a second pass without it fills the rest of the budget
+   ---------------------------------------------------------------------------------------------------------*/
+void FeatureDetection::selectKeypoints (std::vector<cv::KeyPoint> &keypoints, cv::Mat &descriptor, cv::Size imageSize)
+{
+	select_size = imageSize;
+	if (select_budget <= 0 || keypoints.size() <= select_budget)
+		return;
+
+	int numOfCells = select_cols * select_rows;
+
+	// the response times the expected backprojection of the cell, 0.5 while nothing is known about it
+	vector<int> cells(keypoints.size());
+	vector<float> scores(keypoints.size());
+	for (int i = 0; i < keypoints.size(); i++)
+	{
+		cells[i]  = gridCell(keypoints[i].pt);
+		scores[i] = keypoints[i].response * (float)((cell_hits[cells[i]] + 1.0) / (cell_tries[cells[i]] + 2.0));
+	}
+
+	vector<int> order(keypoints.size());
+	iota(order.begin(), order.end(), 0);
+	stable_sort(order.begin(), order.end(), [&scores](int a, int b) { return scores[a] > scores[b]; });
+
+	// twice the even share, so the textured cells can take what the empty ones leave
+	int cellCap = std::max(1, 2 * select_budget / numOfCells);
+	double radius = std::sqrt((double)imageSize.area() / (CV_PI * select_budget));
+
+	// the taken keypoints hashed into bins of the radius, the neighbours of a keypoint are in the 3x3 bins around it
+	int binCols = (int)ceil(imageSize.width / radius) + 1;
+	int binRows = (int)ceil(imageSize.height / radius) + 1;
+	vector<vector<Point2f> > bins(binCols * binRows);
+
+	vector<int> cellCount(numOfCells, 0);
+	vector<uchar> taken(keypoints.size(), 0);
+	int numOfTaken = 0;
+
+	for (int pass = 0; pass < 2 && numOfTaken < select_budget; pass++)
+	{
+		for (int k = 0; k < order.size() && numOfTaken < select_budget; k++)
+		{
+			int i = order[k];
+			if (taken[i] || cellCount[cells[i]] >= cellCap)
+				continue;
+
+			const Point2f &pt = keypoints[i].pt;
+			int bx = std::min(std::max((int)(pt.x / radius), 0), binCols - 1);
+			int by = std::min(std::max((int)(pt.y / radius), 0), binRows - 1);
+
+			if (pass == 0)
+			{
+				bool suppressed = false;
+				for (int y = std::max(by - 1, 0); y <= std::min(by + 1, binRows - 1) && !suppressed; y++)
+					for (int x = std::max(bx - 1, 0); x <= std::min(bx + 1, binCols - 1) && !suppressed; x++)
+						for (int j = 0; j < bins[y * binCols + x].size(); j++)
+						{
+							Point2f d = bins[y * binCols + x][j] - pt;
+							if (d.dot(d) < radius * radius)
+							{
+								suppressed = true;
+								break;
+							}
+						}
+				if (suppressed)
+					continue;
+			}
+
+			bins[by * binCols + bx].push_back(pt);
+			taken[i] = 1;
+			cellCount[cells[i]]++;
+			numOfTaken++;
+		}
+	}
+
+	// keep the image order, the descriptor rows follow their keypoints
+	vector<KeyPoint> selected;
+	selected.reserve(numOfTaken);
+	Mat selectedDescriptor;
+	if (!descriptor.empty())
+		selectedDescriptor.create(numOfTaken, descriptor.cols, descriptor.type());
+
+	for (int i = 0; i < keypoints.size(); i++)
+	{
+		if (!taken[i])
+			continue;
+		if (!descriptor.empty())
+			descriptor.row(i).copyTo(selectedDescriptor.row(selected.size()));
+		selected.push_back(keypoints[i]);
+	}
+
+	keypoints.swap(selected);
+	descriptor = selectedDescriptor;
+}
+
+void FeatureDetection::updateBackprojection (const std::vector<cv::KeyPoint> &keypoints, const std::vector<int> &reprojectedIndices)
+{
+	if (select_size.area() == 0)
+		return;
+
+	// the older frames fade out, the rates follow the tunnel
+	for (int c = 0; c < cell_tries.size(); c++)
+	{
+		cell_tries[c] *= 0.8;
+		cell_hits[c]  *= 0.8;
+	}
+
+	for (int i = 0; i < keypoints.size(); i++)
+		cell_tries[gridCell(keypoints[i].pt)] += 1.0;
+	for (int i = 0; i < reprojectedIndices.size(); i++)
+		cell_hits[gridCell(keypoints[reprojectedIndices[i]].pt)] += 1.0;
+}
+
+void FeatureDetection::refineKeypoints (cv::Mat img, std::vector<cv::KeyPoint> &keypoints, int window)
+{
+	if (keypoints.empty())
+		return;
+
+	Mat gray = img;
+	if (img.channels() > 1)
+		cvtColor(img, gray, COLOR_BGR2GRAY);
+
+	vector<Point2f> points;
+	KeyPoint::convert(keypoints, points);
+
+	// the gradients of a blob point to its center like the ones of a corner, so the same estimator fits both
+	cornerSubPix(gray, points, Size(window, window), Size(-1, -1),
+				 TermCriteria(TermCriteria::EPS + TermCriteria::COUNT, 10, 0.01));
+
+	// keep the reduced resolution position if the refinement left its reduced resolution pixel, e.g. along an edge
+	for (int i = 0; i < keypoints.size(); i++)
+	{
+		Point2f d = points[i] - keypoints[i].pt;
+		if (std::abs(d.x) <= window && std::abs(d.y) <= window)
+			keypoints[i].pt = points[i];
+	}
+}
+
 void FeatureDetection::bfMatcher (cv::Mat queryDesc, cv::Mat trainDesc, std::vector<std::vector<DMatch> > &matches)
 {
 	// matching using BF L2
@@ -319,6 +849,168 @@ void FeatureDetection::ratioTestRansac (vector<vector<DMatch> > &matches, Frame
         curr.matchedWorldPoints.push_back(prev.reprojectedWorldPoints[prev2Drefined[i]]);
         // current image points are obtained from the keypoints
         curr.matchedImagePoints.push_back(curr.keypoints[curr2Drefined[i]].pt);
+        // the landmark id follows the track
+        curr.matchedIds.push_back(prev.reprojectedIds[prev2Drefined[i]]);
+        curr.matchedKeypoints.push_back(curr2Drefined[i]);
+        curr.setKeypointId(curr2Drefined[i], prev.reprojectedIds[prev2Drefined[i]]);
+    }
+}
+
+/*
+    mutual matching in a single sweep over the distance matrix.
+
+    the squared L2 distances are computed block by block as |q|^2 + |t|^2 - 2*q*t^T (one gemm per block of query rows),
+    and every distance updates both the best/2nd-best of its query row and of its train column. so the backward matches
+    come for free, instead of running knnMatch twice. a match is kept if it passes Lowe's ratio test and both descriptors
+    are each other's best match, which removes the duplicated 3D-to-2D assignments before the PnP.
+
+    binary descriptors (ORB, AKAZE) are compared by their hamming distance instead, with a popcount per 64 bits.
+*/
+void FeatureDetection::mutualMatcher (cv::Mat queryDesc, cv::Mat trainDesc, std::vector<cv::DMatch> &matches, std::vector<float> &scores)
+{
+    const int BLOCKSIZE = 256;
+
+    matches.clear();
+    scores.clear();
+    if ((queryDesc.rows < 2) || (trainDesc.rows < 2))
+        return;
+
+    int numQuery = queryDesc.rows;
+    int numTrain = trainDesc.rows;
+
+    vector<float> rowBest(numQuery, FLT_MAX), rowSecond(numQuery, FLT_MAX);
+    vector<float> colBest(numTrain, FLT_MAX), colSecond(numTrain, FLT_MAX);
+    vector<int>   rowIdx(numQuery, -1), colIdx(numTrain, -1);
+
+    // every distance updates both directions
+    auto visit = [&](int i, int j, float v, float &best, float &second, int &bestIdx)
+    {
+        // forward (query to train)
+        if (v < best)        { second = best; best = v; bestIdx = j; }
+        else if (v < second) { second = v; }
+
+        // backward (train to query)
+        if (v < colBest[j])        { colSecond[j] = colBest[j]; colBest[j] = v; colIdx[j] = i; }
+        else if (v < colSecond[j]) { colSecond[j] = v; }
+    };
+
+    bool binary = isBinaryDescriptor(queryDesc) && isBinaryDescriptor(trainDesc);
+    if (binary)
+    {
+        // hamming distances, one popcount per 64 bits of the descriptors
+        int numBytes = queryDesc.cols;
+        for (int i=0; i<numQuery; i++)
+        {
+            const uchar *q    = queryDesc.ptr<uchar>(i);
+            float        best = FLT_MAX, second = FLT_MAX;
+            int          bestIdx = -1;
+
+            for (int j=0; j<numTrain; j++)
+                visit(i, j, (float)hammingDistance(q, trainDesc.ptr<uchar>(j), numBytes), best, second, bestIdx);
+
+            rowBest[i] = best; rowSecond[i] = second; rowIdx[i] = bestIdx;
+        }
+    }
+    else
+    {
+        Mat query, train;
+        queryDesc.convertTo(query, CV_32F);
+        trainDesc.convertTo(train, CV_32F);
+
+        // squared norms of every descriptor
+        Mat queryNorm, trainNorm;
+        reduce(query.mul(query), queryNorm, 1, REDUCE_SUM);
+        reduce(train.mul(train), trainNorm, 1, REDUCE_SUM);
+        const float *tn = trainNorm.ptr<float>(0);
+
+        Mat dist;
+        for (int r0=0; r0<numQuery; r0+=BLOCKSIZE)
+        {
+            int r1 = min(r0+BLOCKSIZE, numQuery);
+            gemm(query.rowRange(r0, r1), train, -2.0, noArray(), 0, dist, GEMM_2_T);
+
+            for (int i=r0; i<r1; i++)
+            {
+                const float *d  = dist.ptr<float>(i-r0);
+                float        qn = queryNorm.at<float>(i);
+                float        best = rowBest[i], second = rowSecond[i];
+                int          bestIdx = rowIdx[i];
+
+                for (int j=0; j<numTrain; j++)
+                    visit(i, j, d[j] + qn + tn[j], best, second, bestIdx);
+
+                rowBest[i] = best; rowSecond[i] = second; rowIdx[i] = bestIdx;
+            }
+        }
+    }
+
+    // keep the mutual matches that pass the ratio test
+    vector<DMatch> candidates;
+    vector<float>  ratios;
+    for (int i=0; i<numQuery; i++)
+    {
+        int j = rowIdx[i];
+        if ((j < 0) || (colIdx[j] != i))
+            continue;
+
+        // the float distances are squared
+        float dist1 = binary ? rowBest[i]   : sqrt(max(rowBest[i], 0.0f));
+        float dist2 = binary ? rowSecond[i] : sqrt(max(rowSecond[i], 0.0f));
+        if (dist1 < this->getSiftMatchingRatio() * dist2)
+        {
+            candidates.push_back(DMatch(i, j, dist1));
+            ratios.push_back(dist1 / dist2);
+        }
+    }
+
+    // sort by the ratio, the most distinctive match first
+    vector<int> order(candidates.size());
+    iota(order.begin(), order.end(), 0);
+    sort(order.begin(), order.end(), [&ratios](int a, int b) { return ratios[a] < ratios[b]; });
+
+    for (int i=0; i<order.size(); i++)
+    {
+        matches.push_back(candidates[order[i]]);
+        scores.push_back(ratios[order[i]]);
+    }
+}
+
+void FeatureDetection::mutualRansac (vector<DMatch> &matches, vector<float> &scores, Frame &prev, Frame &curr, bool verbose)
+{
+    vector<Point2d> prev2D, curr2D;
+    for (int i=0; i<matches.size(); i++)
+    {
+        prev2D.push_back(prev.reprojectedImagePoints[matches[i].queryIdx]);
+        curr2D.push_back(curr.keypoints[matches[i].trainIdx].pt);
+    }
+
+    // RANSAC using the fundamental matrix (it needs 8 points at least), the order of the matches (by score) is kept
+    vector<uchar> state(matches.size(), 1);
+    if (matches.size() >= 8)
+        findFundamentalMat(prev2D, curr2D, FM_RANSAC, 5, 0.99, state);
+
+    int numOfInliers = 0;
+    for (size_t i = 0; i<state.size(); ++i)
+    {
+        // discards outliers (mask == 0)
+        if (state[i] != 0)
+        {
+            curr.matchedWorldPoints.push_back(prev.reprojectedWorldPoints[matches[i].queryIdx]);
+            curr.matchedImagePoints.push_back(curr.keypoints[matches[i].trainIdx].pt);
+            curr.matchedScores.push_back(scores[i]);
+            curr.matchedIds.push_back(prev.reprojectedIds[matches[i].queryIdx]);
+            curr.matchedKeypoints.push_back(matches[i].trainIdx);
+            curr.setKeypointId(matches[i].trainIdx, prev.reprojectedIds[matches[i].queryIdx]);
+            numOfInliers++;
+        }
+    }
+
+    if (verbose)
+    {
+   cout << "    num of RAW matches (mutual)        : " << matches.size() << endl;
+   cout << "    num of REF matches (RANSAC)        : " << numOfInliers << endl;
+   cout << "    inliers in percent (%)             : " << (double)numOfInliers/(double)matches.size()*100 << endl;
+   cout << endl;
     }
 }
 
@@ -1,5 +1,8 @@
 #include <iostream>
 #include <vector>
+#include <algorithm>
+#include <numeric>
+#include <unordered_set>
 
 #include <opencv2/opencv.hpp>
 #include <opencv2/core/core.hpp>
@@ -11,7 +14,9 @@ using namespace cv;
 
 Frame::Frame()
 {
-    // do nothing
+    this->frameIdx = 0;
+    this->stage    = FRAME_DECODED;
+    this->featureScale = 1.0;
 }
 
 Frame::~Frame()
@@ -19,29 +24,163 @@ Frame::~Frame()
     // destruct nothing
 }
 
+void Frame::setPose(const Pose &pose)
+{
+    this->pose        = pose;
+    this->R           = pose.getRotationMatrix();
+    this->R_rodrigues = pose.getRotationVector();
+    this->t           = pose.getTranslationVector();
+    this->R_invert    = this->R.t();
+    this->t_invert    = Mat(pose.getCameraPosition(), true);
+    this->cameraPose  = pose.getCameraPose();
+}
+
 void Frame::projectWorldtoCamera()
 {
-    this->c_matchedWorldPoints.clear();
-    for (int i=0; i<this->matchedWorldPoints.size(); i++)
+    this->pose.transform(this->matchedWorldPoints, this->c_matchedWorldPoints);
+}
+
+void Frame::projectCameratoWorld()
+{
+    this->pose.inverseTransform(this->c_matchedWorldPoints, this->matchedWorldPoints);
+}
+
+void Frame::sortMatchedPoints()
+{
+    int n = this->matchedWorldPoints.size();
+    bool hasScores    = (this->matchedScores.size() == n);
+    bool hasIds       = (this->matchedIds.size() == n);
+    bool hasKeypoints = (this->matchedKeypoints.size() == n);
+
+    vector<int> order(n);
+    iota(order.begin(), order.end(), 0);
+    if (hasScores)
+        stable_sort(order.begin(), order.end(), [this](int a, int b) { return this->matchedScores[a] < this->matchedScores[b]; });
+
+    // the keyframes of the window are matched one by one, so a keypoint can be matched to landmarks of several of them.
+    // only its best match is kept, and its landmark id follows that one. the keyframes also share landmarks, so two
+    // keypoints can be matched to the same id, one landmark is only observed once by the frame (its best match too)
+    vector<uchar> taken;
+    if (hasKeypoints)
     {
-        Mat w_pointTemp = (Mat1d(3,1) << this->matchedWorldPoints[i].x,
-                                         this->matchedWorldPoints[i].y,
-                                         this->matchedWorldPoints[i].z);
-        Mat c_pointTemp = this->R * w_pointTemp + this->t;
-        this->c_matchedWorldPoints.push_back (Point3d(c_pointTemp));
+        taken.assign(this->keypoints.size(), 0);
+        this->keypointIds.assign(this->keypoints.size(), -1);
+    }
+    unordered_set<int> takenIds;
+
+    vector<Point3d> worldPoints;
+    vector<Point2d> imagePoints;
+    vector<float>   scores;
+    vector<int>     ids;
+    vector<int>     keypointIndices;
+    for (int i=0; i<order.size(); i++)
+    {
+        int k = order[i];
+        if (hasKeypoints && taken[this->matchedKeypoints[k]])
+            continue;
+        if (hasIds && (this->matchedIds[k] >= 0) && !takenIds.insert(this->matchedIds[k]).second)
+            continue;
+
+        if (hasKeypoints)
+        {
+            taken[this->matchedKeypoints[k]] = 1;
+            keypointIndices.push_back(this->matchedKeypoints[k]);
+            if (hasIds)
+                this->keypointIds[this->matchedKeypoints[k]] = this->matchedIds[k];
+        }
+
+        worldPoints.push_back(this->matchedWorldPoints[k]);
+        imagePoints.push_back(this->matchedImagePoints[k]);
+        if (hasScores)
+            scores.push_back(this->matchedScores[k]);
+        if (hasIds)
+            ids.push_back(this->matchedIds[k]);
     }
+
+    this->matchedWorldPoints = worldPoints;
+    this->matchedImagePoints = imagePoints;
+    if (hasScores)
+        this->matchedScores  = scores;
+    if (hasIds)
+        this->matchedIds     = ids;
+    if (hasKeypoints)
+        this->matchedKeypoints = keypointIndices;
 }
 
-void Frame::projectCameratoWorld()
+void Frame::setKeypointId(int keypointIdx, int landmarkId)
+{
+    if (this->keypointIds.size() != this->keypoints.size())
+        this->keypointIds.assign(this->keypoints.size(), -1);
+
+    this->keypointIds[keypointIdx] = landmarkId;
+}
+
+/*
+    the frames of the window live much longer than their pixels are needed, so each transition releases the data of the
+    finished stages. the vectors are swapped with empty ones, clear() alone would keep their capacity
+*/
+void Frame::advance(int stage, bool keepThumbnail)
 {
-    this->matchedWorldPoints.clear();
-    for (int i=0; i<this->c_matchedWorldPoints.size(); i++)
+    if (stage <= this->stage)
+        return;
+
+    if ((this->stage < FRAME_FEATURED) && (stage >= FRAME_FEATURED))
     {
-        Mat c_pointTemp = (Mat1d(3,1) << this->c_matchedWorldPoints[i].x,
-                                         this->c_matchedWorldPoints[i].y,
-                                         this->c_matchedWorldPoints[i].z);
-        Mat w_pointTemp = this->R.inv() * c_pointTemp + ((-(this->R.inv()) * this->t));
-        
-        this->matchedWorldPoints.push_back (Point3d(w_pointTemp));
+        if (keepThumbnail && !this->image.empty())
+        {
+            Mat small;
+            resize(this->image, small, Size(), 0.25, 0.25, INTER_AREA);
+            imencode(".jpg", small, this->thumbnail, vector<int>{IMWRITE_JPEG_QUALITY, 75});
+        }
+        this->image.release();
     }
-}
\ No newline at end of file
+
+    if ((this->stage < FRAME_POSED) && (stage >= FRAME_POSED))
+        vector<vector<DMatch> >().swap(this->matches);
+
+    if ((this->stage < FRAME_MAPPED) && (stage >= FRAME_MAPPED))
+    {
+        // the lookup table keeps its own copy of the descriptors
+        this->featureImage.release();
+        this->descriptors.release();
+        vector<uchar>().swap(this->described);
+        vector<KeyPoint>().swap(this->keypoints);
+        vector<int>().swap(this->keypointIds);
+        vector<int>().swap(this->matchedKeypoints);
+        vector<int>().swap(this->reprojectedIndices);
+    }
+
+    this->stage = stage;
+}
+
+Mat Frame::getThumbnail() const
+{
+    if (this->thumbnail.empty())
+        return Mat();
+    return imdecode(this->thumbnail, IMREAD_COLOR);
+}
+
+Mat Frame::getDescriptors(const vector<int> &indices) const
+{
+    Mat rows(indices.size(), this->descriptors.cols, this->descriptors.type());
+    for (int i=0; i<indices.size(); i++)
+        this->descriptors.row(indices[i]).copyTo(rows.row(i));
+    return rows;
+}
+
+vector<int> Frame::describedKeypoints(const vector<int> &indices) const
+{
+    // the other rows are zero, they would still match something
+    vector<int> described;
+    for (int i=0; i<indices.size(); i++)
+        if (this->described[indices[i]] == 1)
+            described.push_back(indices[i]);
+    return described;
+}
+
+vector<int> Frame::describedKeypoints() const
+{
+    vector<int> all(this->keypoints.size());
+    iota(all.begin(), all.end(), 0);
+    return describedKeypoints(all);
+}
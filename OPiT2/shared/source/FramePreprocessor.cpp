@@ -0,0 +1,174 @@
+#include "FramePreprocessor.h"
+#include "CameraModel.h"
+#include "Calibration.h"
+
+#include <iostream>
+#include <vector>
+#include <string>
+
+#include <opencv2/opencv.hpp>
+#include <opencv2/core/core.hpp>
+
+using namespace std;
+using namespace cv;
+
+// constructor
+FramePreprocessor::FramePreprocessor()
+{
+    Calibration calib;
+    CameraModel camera(calib.getCameraMatrix(), calib.getDistortionCoeffs());
+
+    this->cameraMatrix = camera.getCameraMatrix();
+    this->distCoeffs   = camera.getDistortionCoeffs();
+    this->gray         = true;
+    this->undistort    = true;
+    this->scale        = 1.0;
+    this->roi          = Rect2d(0, 0, 1, 1);
+}
+
+FramePreprocessor::FramePreprocessor(Mat cameraMatrix, Mat distCoeffs)
+{
+    CameraModel camera(cameraMatrix, distCoeffs);
+
+    this->cameraMatrix = camera.getCameraMatrix();
+    this->distCoeffs   = camera.getDistortionCoeffs();
+    this->gray         = true;
+    this->undistort    = true;
+    this->scale        = 1.0;
+    this->roi          = Rect2d(0, 0, 1, 1);
+}
+
+// destructor
+FramePreprocessor::~FramePreprocessor()
+{
+    // do nothing
+}
+
+// every setting invalidates the tables and the mask, they are rebuilt with the next frame
+void FramePreprocessor::setGrayscale(bool gray)
+{
+    this->gray = gray;
+}
+
+void FramePreprocessor::setUndistort(bool undistort)
+{
+    this->undistort = undistort;
+    this->imageSize = Size();
+}
+
+void FramePreprocessor::setScale(double scale)
+{
+    this->scale     = scale;
+    this->imageSize = Size();
+}
+
+void FramePreprocessor::setRoi(Rect2d roi)
+{
+    this->roi       = roi;
+    this->fileMask.release();
+    this->imageSize = Size();
+}
+
+bool FramePreprocessor::loadMask(string filename)
+{
+    Mat loaded = imread(filename, IMREAD_GRAYSCALE);
+    if (loaded.empty())
+    {
+        cerr << "failed to load the mask " << filename << ", keeping the ROI" << endl;
+        return false;
+    }
+
+    this->fileMask  = loaded > 127;
+    this->imageSize = Size();
+    return true;
+}
+
+void FramePreprocessor::configure(Size imageSize)
+{
+    this->imageSize  = imageSize;
+    this->outputSize = Size(cvRound(imageSize.width * scale), cvRound(imageSize.height * scale));
+
+    // fixed-point tables, the fast path of remap
+    map1.release(); map2.release();
+    if (undistort && !distCoeffs.empty())
+        initUndistortRectifyMap(cameraMatrix, distCoeffs, noArray(), cameraMatrix, imageSize, CV_16SC2, map1, map2);
+
+    // the mask of the input frames, in their distorted coordinates like the dashboard it removes
+    Mat inputMask;
+    if (!fileMask.empty())
+        resize(fileMask, inputMask, imageSize, 0, 0, INTER_NEAREST);
+    else
+    {
+        inputMask = Mat::zeros(imageSize, CV_8U);
+        Rect area = Rect(cvRound(roi.x * imageSize.width),     cvRound(roi.y * imageSize.height),
+                         cvRound(roi.width * imageSize.width), cvRound(roi.height * imageSize.height))
+                  & Rect(0, 0, imageSize.width, imageSize.height);
+        inputMask(area) = Scalar(255);
+    }
+
+    // the same way as the frames, the border without any source pixel is masked out too
+    if (!map1.empty())
+        remap(inputMask, mask, map1, map2, INTER_NEAREST, BORDER_CONSTANT, Scalar(0));
+    else
+        mask = inputMask;
+
+    if (outputSize != imageSize)
+        resize(mask, mask, outputSize, 0, 0, INTER_NEAREST);
+}
+
+void FramePreprocessor::apply(const Mat &image, Mat &out)
+{
+    if (image.size() != imageSize)
+        configure(image.size());
+
+    bool toGray   = gray && (image.channels() > 1);
+    bool toRemap  = !map1.empty();
+    bool toResize = (outputSize != imageSize);
+
+    if (!toGray && !toRemap && !toResize)
+    {
+        out = image;
+        return;
+    }
+
+    // every stage writes into its buffer, the last one into out
+    Mat stage = image;
+    if (toGray)
+    {
+        Mat &dst = (toRemap || toResize) ? grayBuffer : out;
+        cvtColor(stage, dst, COLOR_BGR2GRAY);
+        stage = dst;
+    }
+    if (toRemap)
+    {
+        Mat &dst = toResize ? remapBuffer : out;
+        remap(stage, dst, map1, map2, INTER_LINEAR, BORDER_CONSTANT, Scalar::all(0));
+        stage = dst;
+    }
+    if (toResize)
+        resize(stage, out, outputSize, 0, 0, INTER_AREA);
+}
+
+const Mat& FramePreprocessor::getMask() const
+{
+    return mask;
+}
+
+const Mat& FramePreprocessor::getMask(Size imageSize)
+{
+    if (imageSize != this->imageSize)
+        configure(imageSize);
+    return mask;
+}
+
+Mat FramePreprocessor::getCameraMatrix() const
+{
+    return CameraModel::scaleCameraMatrix(cameraMatrix, scale);
+}
+
+Mat FramePreprocessor::getDistortionCoeffs() const
+{
+    if (undistort)
+        return Mat();
+    return distCoeffs;
+}
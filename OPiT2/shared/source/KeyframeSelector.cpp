@@ -0,0 +1,94 @@
+#include "KeyframeSelector.h"
+#include "Frame.h"
+
+#include <iostream>
+#include <vector>
+#include <algorithm>
+#include <cfloat>
+#include <unordered_map>
+
+#include <opencv2/opencv.hpp>
+#include <opencv2/core/core.hpp>
+
+using namespace std;
+using namespace cv;
+
+/*
+    a frame becomes a keyframe (it backprojects its keypoints, feeds the lookup table and enters the bundle adjustment
+    window) when the camera travelled far enough, when the landmarks of the last keyframe moved enough in the image,
+    when the tracking lost too many inliers, or when the last keyframe is too old. the other frames only track.
+*/
+
+// constructor
+KeyframeSelector::KeyframeSelector()
+{
+    this->minDistance     = 1.0;
+    this->minParallax     = 20.0;
+    this->minTrackedRatio = 0.6;
+    this->maxInterval     = 10;
+    this->hasKeyframe     = false;
+}
+
+KeyframeSelector::KeyframeSelector(double minDistance, double minParallax, double minTrackedRatio, int maxInterval)
+{
+    this->minDistance     = minDistance;
+    this->minParallax     = minParallax;
+    this->minTrackedRatio = minTrackedRatio;
+    this->maxInterval     = maxInterval;
+    this->hasKeyframe     = false;
+}
+
+// destructor
+KeyframeSelector::~KeyframeSelector()
+{
+    // do nothing
+}
+
+double KeyframeSelector::medianParallax(const Frame &current)
+{
+    vector<double> parallax;
+    for (int i=0; i<current.matchedIds.size(); i++)
+    {
+        unordered_map<int, Point2d>::const_iterator it = lastImagePoints.find(current.matchedIds[i]);
+        if (it != lastImagePoints.end())
+            parallax.push_back(norm(current.matchedImagePoints[i] - it->second));
+    }
+
+    // no common landmark is as much parallax as we can get
+    if (parallax.empty())
+        return DBL_MAX;
+
+    nth_element(parallax.begin(), parallax.begin() + parallax.size()/2, parallax.end());
+    return parallax[parallax.size()/2];
+}
+
+bool KeyframeSelector::isKeyframe(const Frame &current, int numOfInliers)
+{
+    if (!hasKeyframe)
+        return true;
+
+    if (!current.t_translation.empty())
+        distance += norm(current.t_translation);
+
+    if (current.frameIdx - lastFrameIdx >= maxInterval)
+        return true;
+    if (distance >= minDistance)
+        return true;
+    if (numOfInliers < minTrackedRatio * lastInliers)
+        return true;
+
+    return medianParallax(current) >= minParallax;
+}
+
+void KeyframeSelector::setKeyframe(const Frame &keyframe, int numOfInliers)
+{
+    hasKeyframe  = true;
+    lastFrameIdx = keyframe.frameIdx;
+    lastInliers  = numOfInliers;
+    distance     = 0;
+
+    // the next frames match against the backprojected landmarks of the keyframe
+    lastImagePoints.clear();
+    for (int i=0; i<keyframe.reprojectedIds.size() && i<keyframe.reprojectedImagePoints.size(); i++)
+        lastImagePoints[keyframe.reprojectedIds[i]] = keyframe.reprojectedImagePoints[i];
+}
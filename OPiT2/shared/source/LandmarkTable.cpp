@@ -0,0 +1,123 @@
+#include "LandmarkTable.h"
+
+#include <iostream>
+#include <vector>
+#include <algorithm>
+
+#include <opencv2/opencv.hpp>
+#include <opencv2/core/core.hpp>
+
+using namespace std;
+using namespace cv;
+
+// constructor
+LandmarkTable::LandmarkTable()
+{
+    this->count = 0;
+}
+
+// destructor
+LandmarkTable::~LandmarkTable()
+{
+    // do nothing
+}
+
+/*
+    makes room for at least rows descriptors. the arena doubles, and it is also copied when a copy of the table
+    (e.g. a frame in the bundle adjustment snapshot) still shares it, so the rows seen by the copy are never overwritten
+*/
+void LandmarkTable::grow(int rows, int cols, int type)
+{
+    bool shared = !arena.empty() && (arena.u != NULL) && (arena.u->refcount > 1);
+    if (!arena.empty() && (rows <= arena.rows) && !shared)
+        return;
+
+    Mat larger(max(rows, max(2 * arena.rows, 64)), cols, type);
+    if (count > 0)
+        arena.rowRange(0, count).copyTo(larger.rowRange(0, count));
+    arena = larger;
+}
+
+void LandmarkTable::reserve(int capacity, int descriptorCols, int descriptorType)
+{
+    positions.reserve(capacity);
+    ids.reserve(capacity);
+    grow(capacity, descriptorCols, descriptorType);
+}
+
+void LandmarkTable::append(const Point3d &position, const Mat &descriptor, int id)
+{
+    grow(count + 1, descriptor.cols, descriptor.type());
+    descriptor.copyTo(arena.row(count));
+
+    positions.push_back(position);
+    ids.push_back(id);
+    count++;
+}
+
+void LandmarkTable::append(const vector<Point3d> &positions, const Mat &descriptors, const vector<int> &ids)
+{
+    if (positions.empty())
+        return;
+
+    grow(count + positions.size(), descriptors.cols, descriptors.type());
+    descriptors.copyTo(arena.rowRange(count, count + positions.size()));
+
+    this->positions.insert(this->positions.end(), positions.begin(), positions.end());
+    this->ids.insert(this->ids.end(), ids.begin(), ids.end());
+    count += positions.size();
+}
+
+void LandmarkTable::clear()
+{
+    positions.clear();
+    ids.clear();
+    count = 0;
+}
+
+int LandmarkTable::size() const
+{
+    return count;
+}
+
+bool LandmarkTable::empty() const
+{
+    return count == 0;
+}
+
+const Point3d& LandmarkTable::getPosition(int i) const
+{
+    return positions[i];
+}
+
+void LandmarkTable::setPosition(int i, const Point3d &position)
+{
+    positions[i] = position;
+}
+
+int LandmarkTable::getId(int i) const
+{
+    return ids[i];
+}
+
+const vector<Point3d>& LandmarkTable::getPositions() const
+{
+    return positions;
+}
+
+const vector<int>& LandmarkTable::getIds() const
+{
+    return ids;
+}
+
+Mat LandmarkTable::getDescriptors() const
+{
+    if (count == 0)
+        return Mat();
+    return arena.rowRange(0, count);
+}
+
+Mat LandmarkTable::getDescriptor(int i) const
+{
+    return arena.row(i);
+}
@@ -34,7 +34,7 @@ using namespace std::chrono;
 /* -------------------------------------themaincaller---------------------------------------*/
 int MainWrapper (int argc, char *argv[])
 {
-    vector<pair<Point3d, Mat> >     lookuptable;
+    LandmarkTable                   lookuptable;
     vector<Point3d>                 tunnel3D;
     vector<Point2d>                 tunnel2D;
     vector<int>		                tunnel1D;
@@ -0,0 +1,93 @@
+#include "MotionModel.h"
+#include "Pose.h"
+
+#include <iostream>
+#include <cmath>
+#include <vector>
+
+#include <opencv2/opencv.hpp>
+#include <opencv2/core/core.hpp>
+
+using namespace std;
+using namespace cv;
+
+/*
+    a motion model for the camera, the prediction is used as pose prior of the PnP solver.
+
+    the motion between two tracked frames is expressed per frame index (skipped frames leave a gap), as the rotation vector
+    of R_k * R_{k-1}^t and the translation t_k - dR * t_{k-1}, both taken from the fixed-size pose of the frames. the constant velocity model repeats the last motion,
+    the constant acceleration model extrapolates the change between the last two motions.
+*/
+
+// constructor
+MotionModel::MotionModel()
+{
+    this->model  = MOTION_CONSTANT_VELOCITY;
+    this->maxGap = 5;
+}
+
+MotionModel::MotionModel(int model, int maxGap)
+{
+    this->model  = model;
+    this->maxGap = maxGap;
+}
+
+// destructor
+MotionModel::~MotionModel()
+{
+    // do nothing
+}
+
+void MotionModel::velocity(const TrackedPose &from, const TrackedPose &to, Vec3d &omega, Vec3d &v)
+{
+    // T_1 = dT * T_0
+    Matx33d dR = to.pose.R * from.pose.R.t();
+    Vec3d   dt = to.pose.t - dR * from.pose.t;
+
+    double steps = to.frameIdx - from.frameIdx;
+    Rodrigues(dR, omega);
+    omega = omega * (1.0 / steps);
+    v     = dt * (1.0 / steps);
+}
+
+bool MotionModel::predict(const vector<TrackedPose> &frames, int frameIdx, Mat &rvec, Mat &tvec)
+{
+    int required = (model == MOTION_CONSTANT_ACCELERATION) ? 3 : 2;
+    if (frames.size() < required)
+        return false;
+
+    const TrackedPose &last = frames[frames.size()-1];
+    const TrackedPose &prev = frames[frames.size()-2];
+
+    int gap = frameIdx - last.frameIdx;
+    if ((gap <= 0) || (gap > maxGap) || (last.frameIdx == prev.frameIdx))
+        return false;
+
+    Vec3d omega, v;
+    velocity(prev, last, omega, v);
+
+    if (model == MOTION_CONSTANT_ACCELERATION)
+    {
+        const TrackedPose &first = frames[frames.size()-3];
+        if (prev.frameIdx == first.frameIdx)
+            return false;
+
+        // the velocity at the prediction is extrapolated from the last two velocities
+        Vec3d omega0, v0;
+        velocity(first, prev, omega0, v0);
+
+        double elapsed = 0.5 * ((last.frameIdx - prev.frameIdx) + (prev.frameIdx - first.frameIdx));
+        double ahead   = 0.5 * ((last.frameIdx - prev.frameIdx) + gap);
+        omega = omega + (omega - omega0) * (ahead / elapsed);
+        v     = v + (v - v0) * (ahead / elapsed);
+    }
+
+    // T = dT^gap * T_last, with the small motion approximation for the translation
+    Matx33d dR;
+    Rodrigues(Vec3d(omega * (double)gap), dR);
+
+    Rodrigues(dR * last.pose.R, rvec);
+    tvec = Mat(dR * last.pose.t + v * (double)gap).clone();
+
+    return true;
+}
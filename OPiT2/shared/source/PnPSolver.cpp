@@ -1,6 +1,8 @@
 #include "PnPSolver.h"
 #include "Converter.h"
-#include "Calibration.h"
+#include "CameraModel.h"
+#include "Pose.h"
+#include "RobustLoss.h"
 
 #include <opencv2/video/tracking.hpp>
 #include <opencv2/imgproc/imgproc.hpp>
@@ -12,6 +14,10 @@
 
 #include <iostream>
 #include <iomanip>
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <cfloat>
 
 using namespace cv;
 using namespace std;
@@ -36,12 +42,31 @@ PnPSolver::PnPSolver()
 {
 	setWorldPoints();
 	setVoVImagePoints();
+	paramRansacMethod = PNP_RANSAC_PROSAC;
+	hasPrior = false;
+	paramIterCount  = 100;
+	paramRepError   = 8;
+	paramConfidence = 0.99;
+}
+
+// the camera model is built once per solver, and can be shared by many solvers running in parallel
+PnPSolver::PnPSolver(const CameraModel &camera) : camera(camera)
+{
+	setWorldPoints();
+	setVoVImagePoints();
+	paramRansacMethod = PNP_RANSAC_PROSAC;
+	hasPrior = false;
+	paramIterCount  = 100;
+	paramRepError   = 8;
+	paramConfidence = 0.99;
 }
 
 PnPSolver::PnPSolver(int iterCount, int repError, double confidence)
 {
 	setWorldPoints();
 	setVoVImagePoints();
+	paramRansacMethod = PNP_RANSAC_PROSAC;
+	hasPrior = false;
 	paramIterCount  = iterCount;
 	paramRepError   = repError;
 	paramConfidence = confidence;
@@ -54,12 +79,26 @@ void PnPSolver::setPnPParam(int iterCount, int repError, double confidence)
 	paramConfidence = confidence;
 }
 
-int PnPSolver::run(int verbalOutput)
+// e.g. per frame from Frame::K and Frame::distCoef
+void PnPSolver::setCameraModel(const CameraModel &camera)
+{
+	this->camera = camera;
+}
+
+void PnPSolver::setRansacMethod(int method)
 {
+	paramRansacMethod = method;
+}
 
-	Calibration calib;
+void PnPSolver::setPosePrior(Mat rvec, Mat tvec, double gateError)
+{
+	prior          = Pose::fromRodrigues(rvec, tvec);
+	paramPriorGate = gateError;
+	hasPrior       = true;
+}
 
-	Mat cameraMatrix = calib.getCameraMatrix();
+int PnPSolver::run(int verbalOutput)
+{
 
 
 
@@ -79,7 +118,21 @@ int PnPSolver::run(int verbalOutput)
 	// 	);
 
 
-	Mat inliers;
+	inliers.release();
+	prepareCorrespondences();
+
+	// with a pose prior the robust estimation is only needed when the prior fails
+	bool solved = hasPrior && solveWithPrior();
+	hasPrior = false;
+
+	if (!solved && (paramRansacMethod == PNP_RANSAC_PROSAC))
+	{
+		if (!solveProsac())
+			return -1;
+	}
+	else if (!solved)
+	{
+	Mat rVec, tVec;
 	/*
 	solvePnPRansac(): Finds an object pose from 3D-2D point correspondences using the RANSAC scheme.
 
@@ -94,11 +147,11 @@ int PnPSolver::run(int verbalOutput)
 	/*
 	Use zero distortion, or the distcoeff calculated by calibrateCamera()?
 	*/
-	solvePnPRansac(
+	bool found = solvePnPRansac(
 		Mat(worldPoints),			// Array of world points in the world coordinate space, 3xN/Nx3 1-channel or 1xN/Nx1 3-channel, where N is the number of points.
 		Mat(imagePoints),			// Array of corresponding image points, 2xN/Nx2 1-channel or 1xN/Nx1 2-channel, where N is the number of points.
-		calib.getCameraMatrix(),				// Self-explanatory...
-		calib.getDistortionCoeffs(),// DIST COEFFS, Input vector of distortion coefficients. If null, zero distortion coefficients
+		camera.getCameraMatrix(),				// Self-explanatory...
+		camera.getDistortionCoeffs(),// DIST COEFFS, Input vector of distortion coefficients. If null, zero distortion coefficients
 		rVec,						// Output rotation vector.   Together with tvec, brings points from the model coordinate system to the camera coordinate system.
 		tVec,						// Output translation vector
 		false,						// USE EXTRINSIC GUESS, if true (1), the function uses the provided rvec and tvec values as initial approximations
@@ -110,35 +163,19 @@ int PnPSolver::run(int verbalOutput)
 		inliers,					// INLIERS, output vector that contains indices of inliers in worldPoints and imagePoints.
 		SOLVEPNP_ITERATIVE);				// FLAGS, method for solving a PnP problem.
 
-		//Create the rotation matrix from the vector created above, by using the "Rodrigues"
-		rMat.create(3, 3, DataType<double>::type);
-		Rodrigues(rVec, rMat);
-		//Create the translation matrix from the vector created above, by using the "Rodrigues"
-		tMat.create(3, 3, DataType<double>::type);
-		Rodrigues(tVec, tMat);
+	if (!found)
+		return -1;
 
-		//Instead of only keeping the 4x4 pose matrix, also keep the 3x4
-		cameraPose34.create(3, 4, rMat.type());
-		// Copies the rotation matrix into the camera pose
-		cameraPose34(Range(0, 3), Range(0, 3)) = rMat.t();
-		//Copies tvec into the camera pose
-		cameraPose34(Range(0, 3), Range(3, 4)) = -(rMat.t()) * tVec;
+	pose = Pose::fromRodrigues(rVec, tVec);
+	}
 
 		/*
-		*  Create the camera pose matrix
+		*  The rotation/translation matrices and the camera pose matrix are only built on request from the pose (see getCameraPose())
 		*
 		*		The [R | t] (3x4) matrix is the extrinsic matrix,
 		*			 it describes how the world is transformed relative to the camera
 		*				(how to go from world to image, or image to world coordinates).
 		*/
-		cameraPose.create(4, 4, rMat.type());
-		//Copies the rotation matrix into the camera pose
-		cameraPose(Range(0, 3), Range(0, 3)) = rMat.t();
-		//Copies tvec into the camera pose
-		cameraPose(Range(0, 3), Range(3, 4)) = -(rMat.t()) * tVec;
-		// Fill the last row of the camera pose matrix with [0, 0, 0, 1]
-		double *p = cameraPose.ptr<double>(3);
-		p[0] = p[1] = p[2] = 0; p[3] = 1;
 
 
 
@@ -173,13 +210,8 @@ int PnPSolver::run(int verbalOutput)
 
 		Note that transposed rotation (R^t) does the inverse operation to original rotation but is much faster to calculate than  the inverse (R^-1).
 		*/
-		PnPSolver::cameraPosition.create(3, 1, DataType<double>::type);
-		Mat coords2D = (Mat_<double>(3, 1) << 0, 0, 0);
-
 		//cameraPosition = -1 * rMat.t() * tVec;
-		PnPSolver::cameraPosition = rMat.t() * ((calib.getCameraMatrix().inv() * coords2D) - tVec);
-
-		camPositions.push_back(PnPSolver::cameraPosition.clone());
+		Vec3d cameraPosition = pose.getCameraPosition();
 
 		/*
 			Taken from: https://en.wikipedia.org/wiki/Essential_matrix#3D_points_from_corresponding_image_points
@@ -240,9 +272,9 @@ int PnPSolver::run(int verbalOutput)
 	        //                           << cameraPose.at<double>(2,3) << "]" << endl;
 
 			cout << "[" << std::fixed << setprecision(10)
-									  << cameraPose.at<double>(0,3) << ", "
-									  << cameraPose.at<double>(1,3) << ", "
-									  << cameraPose.at<double>(2,3) << "]" << endl;
+									  << cameraPosition[0] << ", "
+									  << cameraPosition[1] << ", "
+									  << cameraPosition[2] << "]" << endl;
 
 			// cout << "  camera rcal at frame-["  << cameraPosition.at<double>(0) << ", "
             //                                     << cameraPosition.at<double>(1) << ", "
@@ -259,6 +291,382 @@ int PnPSolver::run(int verbalOutput)
 }
 
 
+/*
+	The world points are centered, since the sweref 99 coordinates are too large for a well conditioned solver,
+	and the image points are undistorted once, so every pose hypothesis is scored with a plain pinhole projection.
+*/
+void PnPSolver::prepareCorrespondences()
+{
+	int N = worldPoints.size();
+
+	camera.undistort(imagePoints, undistortedPoints);
+
+	centroid = Point3d(0, 0, 0);
+	for (int i = 0; i < N; i++)
+		centroid += worldPoints[i];
+	if (N > 0)
+		centroid *= 1.0 / N;
+
+	centeredPoints.resize(N);
+	soaX.resize(N); soaY.resize(N); soaZ.resize(N); soaU.resize(N); soaV.resize(N);
+	for (int i = 0; i < N; i++)
+	{
+		centeredPoints[i] = worldPoints[i] - centroid;
+		soaX[i] = centeredPoints[i].x; soaY[i] = centeredPoints[i].y; soaZ[i] = centeredPoints[i].z;
+		soaU[i] = undistortedPoints[i].x; soaV[i] = undistortedPoints[i].y;
+	}
+	scratchMask.resize(N);
+}
+
+/*
+	Gauss-Newton refinement of a pose (centered frame) on the masked correspondences, with a Huber loss.
+	The 6x6 normal equations are accumulated on fixed-size matrices in one pass over the SoA buffers,
+	so an iteration is linear in the number of points and doesn't allocate anything.
+*/
+void PnPSolver::optimizePose(Pose &pose, const vector<uchar> &mask, int iterations)
+{
+	const double HUBER = 2.0;			// in pixel
+
+	const int N = soaX.size();
+	const double *X = soaX.data(), *Y = soaY.data(), *Z = soaZ.data();
+	const double *U = soaU.data(), *V = soaV.data();
+	const uchar *m = mask.data();
+	const double fx = camera.fx, fy = camera.fy, cx = camera.cx, cy = camera.cy;
+
+	Pose last = pose;
+	double lastCost = DBL_MAX;
+
+	for (int it = 0; it < iterations; it++)
+	{
+		const Matx33d &R = pose.R;
+		const Vec3d &t = pose.t;
+
+		Matx66d H = Matx66d::zeros();
+		Vec6d g(0, 0, 0, 0, 0, 0);
+		double cost = 0;
+
+		for (int i = 0; i < N; i++)
+		{
+			double x = R(0,0)*X[i] + R(0,1)*Y[i] + R(0,2)*Z[i] + t[0];
+			double y = R(1,0)*X[i] + R(1,1)*Y[i] + R(1,2)*Z[i] + t[1];
+			double z = R(2,0)*X[i] + R(2,1)*Y[i] + R(2,2)*Z[i] + t[2];
+
+			double iz  = (z > 0) ? 1.0 / z : 0.0;
+			double iz2 = iz * iz;
+			double eu  = fx*x*iz + cx - U[i];
+			double ev  = fy*y*iz + cy - V[i];
+
+			// huber weight, the outliers and the points behind the camera don't contribute
+			double e = sqrt(eu*eu + ev*ev);
+			double valid = (double)(m[i] & (z > 0));
+			double w = huberWeight(e, HUBER) * valid;
+			cost += huberCost(e, HUBER) * valid;
+
+			// jacobian of the projection for x' = exp(omega) * x + v, with delta = [v, omega]
+			double Ju[6] = { fx*iz, 0, -fx*x*iz2, -fx*x*y*iz2, fx + fx*x*x*iz2, -fx*y*iz };
+			double Jv[6] = { 0, fy*iz, -fy*y*iz2, -fy - fy*y*y*iz2, fy*x*y*iz2, fy*x*iz };
+
+			for (int a = 0; a < 6; a++)
+			{
+				g[a] += w * (Ju[a]*eu + Jv[a]*ev);
+				for (int b = a; b < 6; b++)
+					H(a,b) += w * (Ju[a]*Ju[b] + Jv[a]*Jv[b]);
+			}
+		}
+
+		// the last step made it worse
+		if (cost > lastCost)
+		{
+			pose = last;
+			break;
+		}
+
+		for (int a = 0; a < 6; a++)
+			for (int b = 0; b < a; b++)
+				H(a,b) = H(b,a);
+
+		Vec6d delta = H.solve(-g, DECOMP_CHOLESKY);
+
+		last = pose;
+		lastCost = cost;
+		pose.update(delta);
+
+		if (delta.dot(delta) < 1e-16)
+			break;
+	}
+}
+
+/*
+	Refines the pose on the masked correspondences, the result is kept only if it doesn't lose inliers.
+	Returns the new number of inliers.
+*/
+int PnPSolver::refinePose(Pose &pose, double threshold, vector<uchar> &mask)
+{
+	const int GNITERATIONS = 10;
+
+	int count = 0;
+	for (int i = 0; i < mask.size(); i++)
+		count += mask[i];
+	if (count < 4)
+		return count;
+
+	Pose refined = pose;
+	optimizePose(refined, mask, GNITERATIONS);
+
+	int refinedCount = scoreModel(refined, threshold, scratchMask);
+	if (refinedCount < count)
+		return count;
+
+	pose = refined;
+	mask.swap(scratchMask);
+	return refinedCount;
+}
+
+// keeps the pose (given in the centered frame) and its inliers, x_cam = R*(X - c) + t'  =>  t = t' - R*c
+void PnPSolver::setResult(const Pose &centered, const vector<uchar> &mask)
+{
+	pose = Pose(centered.R, centered.t - centered.R * Vec3d(centroid.x, centroid.y, centroid.z));
+
+	int count = 0;
+	for (int i = 0; i < mask.size(); i++)
+		count += mask[i];
+
+	inliers.create(count, 1, CV_32S);
+	for (int i = 0, j = 0; i < mask.size(); i++)
+		if (mask[i])
+			inliers.at<int>(j++) = i;
+}
+
+/*
+	Tracking with a pose prior (e.g. from the motion model), the consecutive frames are only centimetres apart.
+	The correspondences are gated by their reprojection error under the prior, and the pose is refined directly on the
+	gated ones. It fails (and the robust estimation takes over) when the refined pose doesn't explain enough points.
+*/
+bool PnPSolver::solveWithPrior()
+{
+	const double MININLIERRATIO = 0.5;
+
+	int N = centeredPoints.size();
+	if (N < 4)
+		return false;
+
+	// the prior is given in the sweref 99 frame, t' = t + R*c
+	Pose centered(prior.R, prior.t + prior.R * Vec3d(centroid.x, centroid.y, centroid.z));
+
+	vector<uchar> mask(N);
+	if (scoreModel(centered, paramPriorGate * paramPriorGate, mask) < 4)
+		return false;
+
+	// refit on the gated points, then keep the inliers of the usual threshold
+	double threshold = (double)paramRepError * paramRepError;
+	refinePose(centered, paramPriorGate * paramPriorGate, mask);
+	scoreModel(centered, threshold, mask);
+	int count = refinePose(centered, threshold, mask);
+
+	if (count < MININLIERRATIO * N)
+		return false;
+
+	setResult(centered, mask);
+	return true;
+}
+
+/*
+	PROSAC with local optimization, replacing solvePnPRansac and its fixed number of iterations.
+
+		O. Chum and J. Matas, "Matching with PROSAC - Progressive Sample Consensus", CVPR 2005
+		O. Chum, J. Matas and J. Kittler, "Locally Optimized RANSAC", DAGM 2003
+
+	The correspondences have to be ordered by match quality (best first, see Frame::sortMatchedPoints()),
+	the minimal samples are drawn from a growing set of the best ones, so a good pose is usually found in a few iterations.
+	The number of iterations adapts to the inlier ratio of the best pose, paramIterCount is only the upper bound.
+	Every new best pose is refined on its inliers (local optimization), and the final pose on all inliers.
+*/
+bool PnPSolver::solveProsac()
+{
+	const int SAMPLESIZE = 4;			// P3P needs a 4th point to pick one of its solutions
+	const int LOITERATIONS = 4;
+
+	int N = centeredPoints.size();
+	if (N < SAMPLESIZE)
+		return false;
+
+	double threshold = (double)paramRepError * paramRepError;
+
+	// PROSAC growth function, T_n is the expected number of samples drawn from the n best points
+	double Tn = paramIterCount;
+	for (int i = 0; i < SAMPLESIZE; i++)
+		Tn *= (double)(SAMPLESIZE - i) / (N - i);
+	double TnPrime = 1;
+	int n = SAMPLESIZE;
+
+	int maxIterations = paramIterCount;
+	int bestCount = 0;
+	Pose best;
+	vector<uchar> mask(N), bestMask(N);
+
+	RNG rng(0x12345);
+	vector<Point3d> sample3D(SAMPLESIZE);
+	vector<Point2d> sample2D(SAMPLESIZE);
+	int sample[SAMPLESIZE];
+	Mat rvec, tvec;
+
+	for (int t = 1; t <= maxIterations; t++)
+	{
+		if ((t > TnPrime) && (n < N))
+		{
+			double TnNext = Tn * (n + 1) / (n + 1 - SAMPLESIZE);
+			TnPrime += ceil(TnNext - Tn);
+			Tn = TnNext;
+			n++;
+		}
+
+		// the sample is the n-th point plus m-1 points of the n-1 best, or m points of the n best once T'_n is reached
+		int k = 0;
+		int poolSize = n;
+		if (t <= TnPrime)
+		{
+			sample[k++] = n - 1;
+			poolSize = n - 1;
+		}
+		while (k < SAMPLESIZE)
+		{
+			int idx = rng.uniform(0, poolSize);
+			if (find(sample, sample + k, idx) == sample + k)
+				sample[k++] = idx;
+		}
+
+		for (int i = 0; i < SAMPLESIZE; i++)
+		{
+			sample3D[i] = centeredPoints[sample[i]];
+			sample2D[i] = undistortedPoints[sample[i]];
+		}
+		if (!solvePnP(sample3D, sample2D, camera.getK(), noArray(), rvec, tvec, false, SOLVEPNP_P3P))
+			continue;
+
+		Pose hypothesis = Pose::fromRodrigues(rvec, tvec);
+		int count = scoreModel(hypothesis, threshold, mask);
+		if (count <= bestCount)
+			continue;
+
+		bestCount = count;
+		best = hypothesis;
+		bestMask.swap(mask);
+
+		// local optimization, refit on the inliers as long as their number grows
+		for (int lo = 0; lo < LOITERATIONS; lo++)
+		{
+			int countLO = refinePose(best, threshold, bestMask);
+			if (countLO <= bestCount)
+				break;
+			bestCount = countLO;
+		}
+
+		// adaptive termination, k = log(1-p) / log(1-w^m)
+		double w = (double)bestCount / N;
+		double denominator = log(1.0 - pow(w, SAMPLESIZE));
+		if (denominator < 0)
+			maxIterations = min(maxIterations, (int)ceil(log(1.0 - paramConfidence) / denominator));
+	}
+
+	if (bestCount < SAMPLESIZE)
+		return false;
+
+	// final refinement on all inliers
+	refinePose(best, threshold, bestMask);
+	setResult(best, bestMask);
+
+	return true;
+}
+
+/*
+	Counts the inliers of a pose, the points are projected in one tight loop over the SoA buffers.
+	There is no branch inside the loop, so the compiler can vectorize it.
+*/
+int PnPSolver::scoreModel(const Pose &pose, double threshold, vector<uchar> &mask)
+{
+	const int N = soaX.size();
+	const double *X = soaX.data(), *Y = soaY.data(), *Z = soaZ.data();
+	const double *U = soaU.data(), *V = soaV.data();
+	uchar *m = mask.data();
+
+	const Matx33d &R = pose.R;
+	const double r00 = R(0,0), r01 = R(0,1), r02 = R(0,2);
+	const double r10 = R(1,0), r11 = R(1,1), r12 = R(1,2);
+	const double r20 = R(2,0), r21 = R(2,1), r22 = R(2,2);
+	const double t0 = pose.t[0], t1 = pose.t[1], t2 = pose.t[2];
+	const double fx = camera.fx, fy = camera.fy, cx = camera.cx, cy = camera.cy;
+
+	int count = 0;
+	for (int i = 0; i < N; i++)
+	{
+		double x = r00*X[i] + r01*Y[i] + r02*Z[i] + t0;
+		double y = r10*X[i] + r11*Y[i] + r12*Z[i] + t1;
+		double z = r20*X[i] + r21*Y[i] + r22*Z[i] + t2;
+
+		double iz = 1.0 / z;
+		double du = fx*x*iz + cx - U[i];
+		double dv = fy*y*iz + cy - V[i];
+
+		// points behind the camera are never inliers
+		uchar inlier = (uchar)((z > 0) & (du*du + dv*dv < threshold));
+		m[i] = inlier;
+		count += inlier;
+	}
+
+	return count;
+}
+/*
+	Batch solving, e.g. re-solving the poses of a whole run from the logged correspondences or after a map update.
+	A solver is stateful, so every problem is solved by its own solver and the problems don't share anything.
+*/
+class PnPBatchBody : public ParallelLoopBody
+{
+public:
+	PnPBatchBody(const vector<PnPProblem> &problems, vector<PnPResult> &results) : problems(problems), results(results) {}
+
+	void operator()(const Range &range) const
+	{
+		for (int i = range.start; i < range.end; i++)
+		{
+			const PnPProblem &problem = problems[i];
+			PnPResult &result = results[i];
+
+			chrono::high_resolution_clock::time_point start = chrono::high_resolution_clock::now();
+
+			PnPSolver solver(problem.camera);
+			solver.setPnPParam(problem.iterCount, problem.repError, problem.confidence);
+			solver.setRansacMethod(problem.method);
+			solver.setWorldPoints(problem.worldPoints);
+			solver.setImagePoints(problem.imagePoints);
+
+			result.success = (solver.run(0) == 0);
+			if (result.success)
+			{
+				result.rvec       = solver.getRotationVector();
+				result.tvec       = solver.getTranslationVector();
+				result.cameraPose = solver.getCameraPose();
+
+				Mat inliers = solver.getInliers();
+				result.inlierMask.assign(problem.worldPoints.size(), 0);
+				for (int j = 0; j < inliers.total(); j++)
+					result.inlierMask[inliers.at<int>(j)] = 1;
+				result.numInliers = inliers.total();
+			}
+
+			result.time = chrono::duration<double, milli>(chrono::high_resolution_clock::now() - start).count();
+		}
+	}
+
+private:
+	const vector<PnPProblem> &problems;
+	vector<PnPResult> &results;
+};
+
+void PnPSolver::solveBatch(const vector<PnPProblem> &problems, vector<PnPResult> &results)
+{
+	results.assign(problems.size(), PnPResult());
+	parallel_for_(Range(0, problems.size()), PnPBatchBody(problems, results));
+}
 
 // Use default image points, not recommended
 void PnPSolver::setImagePoints()
@@ -339,34 +747,51 @@ vector<cv::Point3d> PnPSolver::getWorldPoints()
 
 Mat PnPSolver::getRotationVector()
 {
-	return PnPSolver::rVec;
+	return pose.getRotationVector();
 }
 Mat PnPSolver::getRotationMatrix()
 {
-	return PnPSolver::rMat;
+	return pose.getRotationMatrix();
 }
 Mat PnPSolver::getTranslationVector()
 {
-	return PnPSolver::tVec;
+	return pose.getTranslationVector();
 }
 Mat PnPSolver::getTranslationMatrix()
 {
-	return PnPSolver::tMat;
+	// kept for compatibility, the rodrigues of the translation vector
+	Mat tMat;
+	Rodrigues(pose.getTranslationVector(), tMat);
+	return tMat;
 }
 cv::Mat PnPSolver::getCameraPose()
 {
-	return PnPSolver::cameraPose;
+	return pose.getCameraPose();
 }
 cv::Mat PnPSolver::getCameraPosition()
 {
-	return PnPSolver::cameraPosition;
+	return Mat(pose.getCameraPosition(), true);
+}
+
+cv::Mat PnPSolver::getCameraPose34()
+{
+	return pose.getCameraPose34();
+}
+
+const Pose& PnPSolver::getPose()
+{
+	return pose;
+}
+
+cv::Mat PnPSolver::getInliers()
+{
+	return PnPSolver::inliers;
 }
 
 cv::Mat PnPSolver::getEssentialMatrix()
 {
-	Calibration calib;
 	Mat mask;
-	Mat cameraMatrix = calib.getCameraMatrix();
+	Mat cameraMatrix = camera.getCameraMatrix();
 	/*
 	findEssentialMat() declared in: https://github.com/Itseez/opencv/blob/master/modules/calib3d/src/five-point.cpp
 	*/
@@ -0,0 +1,183 @@
+#include "Pose.h"
+
+#include <iostream>
+
+#include <opencv2/opencv.hpp>
+#include <opencv2/core/core.hpp>
+
+using namespace std;
+using namespace cv;
+
+/* ---------------------------------------------------------------------------------------------------------
+    points as structure of arrays
+   ---------------------------------------------------------------------------------------------------------*/
+int PointSet3d::size() const
+{
+    return x.size();
+}
+
+void PointSet3d::resize(int n)
+{
+    x.resize(n);
+    y.resize(n);
+    z.resize(n);
+}
+
+void PointSet3d::clear()
+{
+    x.clear();
+    y.clear();
+    z.clear();
+}
+
+void PointSet3d::push_back(const Point3d &p)
+{
+    x.push_back(p.x);
+    y.push_back(p.y);
+    z.push_back(p.z);
+}
+
+Point3d PointSet3d::operator[](int i) const
+{
+    return Point3d(x[i], y[i], z[i]);
+}
+
+void PointSet3d::toPoints(vector<Point3d> &points) const
+{
+    points.resize(x.size());
+    for (int i=0; i<x.size(); i++)
+        points[i] = Point3d(x[i], y[i], z[i]);
+}
+
+/* ------------------------------------------------------------------------------------------------ */
+
+// constructor
+Pose::Pose()
+{
+    this->R = Matx33d::eye();
+    this->t = Vec3d(0, 0, 0);
+}
+
+Pose::Pose(const Matx33d &R, const Vec3d &t)
+{
+    this->R = R;
+    this->t = t;
+}
+
+Pose Pose::fromRodrigues(Mat rvec, Mat tvec)
+{
+    Pose pose;
+    Mat rvec64, tvec64;
+    rvec.convertTo(rvec64, CV_64F);
+    tvec.convertTo(tvec64, CV_64F);
+
+    Rodrigues(rvec64, pose.R);
+    pose.t = Vec3d(tvec64.ptr<double>());
+    return pose;
+}
+
+Vec3d Pose::transform(const Vec3d &X) const
+{
+    return R * X + t;
+}
+
+// x_cam = R * X + t for every point, the rotation is kept in registers and the outputs are written as separate arrays
+void Pose::transform(const vector<Point3d> &world, PointSet3d &camera) const
+{
+    const int N = world.size();
+    camera.resize(N);
+
+    const double r00 = R(0,0), r01 = R(0,1), r02 = R(0,2);
+    const double r10 = R(1,0), r11 = R(1,1), r12 = R(1,2);
+    const double r20 = R(2,0), r21 = R(2,1), r22 = R(2,2);
+    const double t0 = t[0], t1 = t[1], t2 = t[2];
+
+    const Point3d *W = world.data();
+    double *X = camera.x.data(), *Y = camera.y.data(), *Z = camera.z.data();
+    for (int i=0; i<N; i++)
+    {
+        const double wx = W[i].x, wy = W[i].y, wz = W[i].z;
+        X[i] = r00*wx + r01*wy + r02*wz + t0;
+        Y[i] = r10*wx + r11*wy + r12*wz + t1;
+        Z[i] = r20*wx + r21*wy + r22*wz + t2;
+    }
+}
+
+// X = R^t * (x_cam - t), no inverse matrix is built
+void Pose::inverseTransform(const PointSet3d &camera, vector<Point3d> &world) const
+{
+    const int N = camera.size();
+    world.resize(N);
+
+    const double r00 = R(0,0), r01 = R(0,1), r02 = R(0,2);
+    const double r10 = R(1,0), r11 = R(1,1), r12 = R(1,2);
+    const double r20 = R(2,0), r21 = R(2,1), r22 = R(2,2);
+    const double t0 = t[0], t1 = t[1], t2 = t[2];
+
+    const double *X = camera.x.data(), *Y = camera.y.data(), *Z = camera.z.data();
+    Point3d *W = world.data();
+    for (int i=0; i<N; i++)
+    {
+        const double cx = X[i] - t0, cy = Y[i] - t1, cz = Z[i] - t2;
+        W[i].x = r00*cx + r10*cy + r20*cz;
+        W[i].y = r01*cx + r11*cy + r21*cz;
+        W[i].z = r02*cx + r12*cy + r22*cz;
+    }
+}
+
+Pose Pose::inverse() const
+{
+    Matx33d Rt = R.t();
+    return Pose(Rt, -(Rt * t));
+}
+
+Vec3d Pose::getCameraPosition() const
+{
+    return -(R.t() * t);
+}
+
+Pose Pose::operator*(const Pose &other) const
+{
+    return Pose(R * other.R, R * other.t + t);
+}
+
+void Pose::update(const Vec6d &delta)
+{
+    Matx33d dR;
+    Rodrigues(Vec3d(delta[3], delta[4], delta[5]), dR);
+
+    R = dR * R;
+    t = dR * t + Vec3d(delta[0], delta[1], delta[2]);
+}
+
+Mat Pose::getRotationVector() const
+{
+    Mat rvec;
+    Rodrigues(R, rvec);
+    return rvec;
+}
+
+Mat Pose::getRotationMatrix() const
+{
+    return Mat(R, true);
+}
+
+Mat Pose::getTranslationVector() const
+{
+    return Mat(t, true);
+}
+
+Mat Pose::getCameraPose() const
+{
+    Pose inv = inverse();
+
+    Mat T = Mat::eye(4, 4, CV_64F);
+    Mat(inv.R).copyTo(T(Range(0, 3), Range(0, 3)));
+    Mat(inv.t).copyTo(T(Range(0, 3), Range(3, 4)));
+    return T;
+}
+
+Mat Pose::getCameraPose34() const
+{
+    return getCameraPose().rowRange(0, 3).clone();
+}
@@ -0,0 +1,306 @@
+#include "Relocalization.h"
+#include "VocabularyTree.h"
+
+#include <iostream>
+#include <cmath>
+#include <algorithm>
+#include <map>
+#include <string>
+#include <vector>
+
+#include <opencv2/opencv.hpp>
+#include <opencv2/core/core.hpp>
+
+using namespace std;
+using namespace cv;
+
+/*
+    relocalization against the tunnel map.
+
+    the map landmarks are grouped into segments, a segment is a square cell of segmentLength meter on the ground plane (x,y).
+    when the tracking is lost (or at startup), the vocabulary tree retrieves the best candidate segments for the current frame,
+    and only their landmarks are matched before solving the PnP. this avoids a brute-force match against the whole tunnel.
+*/
+
+// constructor
+Relocalization::Relocalization()
+{
+    this->vocabulary    = VocabularyTree(10, 4);
+    this->store         = NULL;
+    this->segmentLength = 20.0;
+    this->numLandmarks  = 0;
+}
+
+Relocalization::Relocalization(int branching, int depth, double segmentLength)
+{
+    this->vocabulary    = VocabularyTree(branching, depth);
+    this->store         = NULL;
+    this->segmentLength = segmentLength;
+    this->numLandmarks  = 0;
+}
+
+// destructor
+Relocalization::~Relocalization()
+{
+    // do nothing
+}
+
+bool Relocalization::prepareVocabulary(string vocabularyFile, Mat mapDescriptors)
+{
+    bool loaded = vocabulary.load(vocabularyFile);
+    if (loaded)
+    {
+        cout << "loaded vocabulary with " << vocabulary.getNumWords() << " words" << endl;
+    }
+    else
+    {
+        // not saved, a few map descriptors only make a vocabulary too small to rank the segments
+        cerr << "no vocabulary found in " << vocabularyFile << ", training from " << mapDescriptors.rows << " map descriptors" << endl;
+        if (!mapDescriptors.empty())
+            vocabulary.train(mapDescriptors);
+    }
+
+    indexSegments();
+    return loaded;
+}
+
+bool Relocalization::trainVocabulary(string vocabularyFile, Mat mapDescriptors)
+{
+    vocabulary.train(mapDescriptors);
+    indexSegments();
+
+    cout << "trained the vocabulary with " << vocabulary.getNumWords() << " words from " << mapDescriptors.rows << " descriptors" << endl;
+    return vocabulary.save(vocabularyFile);
+}
+
+void Relocalization::indexSegments()
+{
+    // loading or training a vocabulary clears the inverted file, so index the current map again
+    for (int s=0; s<segments.size(); s++)
+    {
+        if (store != NULL)
+        {
+            Mat descriptors;
+            store->getDescriptors(segments[s].storeIndices, descriptors);
+            vocabulary.addToSegment(s, descriptors);
+        }
+        else
+            vocabulary.addToSegment(s, segments[s].descriptors);
+    }
+}
+
+bool Relocalization::save(string mapFilename)
+{
+    FileStorage storage(mapFilename, FileStorage::WRITE);
+    if (!storage.isOpened())
+        return false;
+
+    // flattened segment by segment, load rebuilds the segments from the positions
+    vector<Point3d> points;
+    vector<int>     ids;
+    vector<int>     storeIndices;
+    Mat             descriptors;
+    for (int s=0; s<segments.size(); s++)
+    {
+        points.insert(points.end(), segments[s].points.begin(), segments[s].points.end());
+        ids.insert(ids.end(), segments[s].ids.begin(), segments[s].ids.end());
+        storeIndices.insert(storeIndices.end(), segments[s].storeIndices.begin(), segments[s].storeIndices.end());
+        descriptors.push_back(segments[s].descriptors);
+    }
+
+    storage << "segmentLength" << segmentLength;
+    storage << "points"        << points;
+    storage << "ids"           << ids;
+    if (store != NULL)
+        storage << "storeIndices" << storeIndices;
+    else
+        storage << "descriptors"  << descriptors;
+    storage.release();
+
+    return true;
+}
+
+bool Relocalization::load(string mapFilename)
+{
+    FileStorage storage(mapFilename, FileStorage::READ);
+    if (!storage.isOpened())
+        return false;
+
+    double          length = 0;
+    vector<Point3d> points;
+    vector<int>     ids;
+    vector<int>     storeIndices;
+    Mat             descriptors;
+    storage["segmentLength"] >> length;
+    storage["points"]        >> points;
+    storage["ids"]           >> ids;
+    if (store != NULL)
+        storage["storeIndices"] >> storeIndices;
+    else
+        storage["descriptors"]  >> descriptors;
+    storage.release();
+
+    // a compressed map only holds together with the store it was saved with
+    bool consistent = (length > 0) && (ids.size() == points.size());
+    if (store != NULL)
+    {
+        consistent = consistent && (storeIndices.size() == points.size());
+        for (int i=0; consistent && (i<storeIndices.size()); i++)
+            consistent = (storeIndices[i] >= 0) && (storeIndices[i] < store->size());
+    }
+    else
+        consistent = consistent && (descriptors.rows == points.size());
+
+    if (!consistent)
+    {
+        cerr << "the map in " << mapFilename << " doesn't match its descriptors, starting the map over" << endl;
+        return false;
+    }
+
+    segmentLength = length;
+    segments.clear();
+    cellToSegment.clear();
+    for (int i=0; i<points.size(); i++)
+    {
+        Segment &segment = segments[getSegmentIdx(points[i])];
+        segment.points.push_back(points[i]);
+        segment.ids.push_back(ids[i]);
+        if (store != NULL)
+            segment.storeIndices.push_back(storeIndices[i]);
+        else
+            segment.descriptors.push_back(descriptors.row(i));
+    }
+    numLandmarks = points.size();
+
+    vocabulary.clearSegments();
+    indexSegments();
+
+    return true;
+}
+
+int Relocalization::getMaxLandmarkId()
+{
+    int maxId = -1;
+    for (int s=0; s<segments.size(); s++)
+        for (int j=0; j<segments[s].ids.size(); j++)
+            maxId = max(maxId, segments[s].ids[j]);
+    return maxId;
+}
+
+void Relocalization::setDescriptorStore(DescriptorStore *store)
+{
+    this->store = store;
+}
+
+int Relocalization::getSegmentIdx(Point3d point)
+{
+    pair<int, int> cell = make_pair((int)floor(point.x/segmentLength), (int)floor(point.y/segmentLength));
+
+    map<pair<int, int>, int>::iterator it = cellToSegment.find(cell);
+    if (it != cellToSegment.end())
+        return it->second;
+
+    // new segment
+    int segmentIdx = segments.size();
+    cellToSegment[cell] = segmentIdx;
+    segments.push_back(Segment());
+
+    return segmentIdx;
+}
+
+void Relocalization::addLandmarks(const LandmarkTable &landmarks)
+{
+    // group the landmarks by segment first, so the inverted file is updated once per segment
+    map<int, Mat> newDescriptors;
+    for (int i=0; i<landmarks.size(); i++)
+    {
+        int segmentIdx = getSegmentIdx(landmarks.getPosition(i));
+
+        segments[segmentIdx].points.push_back(landmarks.getPosition(i));
+        segments[segmentIdx].ids.push_back(landmarks.getId(i));
+        newDescriptors[segmentIdx].push_back(landmarks.getDescriptor(i));
+    }
+
+    // the descriptors are either encoded into the store or kept as they are
+    for (map<int, Mat>::iterator it = newDescriptors.begin(); it != newDescriptors.end(); it++)
+    {
+        if (store != NULL)
+        {
+            int first = store->add(it->second);
+            for (int i=0; i<it->second.rows; i++)
+                segments[it->first].storeIndices.push_back(first + i);
+        }
+        else
+            segments[it->first].descriptors.push_back(it->second);
+    }
+
+    for (map<int, Mat>::iterator it = newDescriptors.begin(); it != newDescriptors.end(); it++)
+        vocabulary.addToSegment(it->first, it->second);
+
+    numLandmarks += landmarks.size();
+}
+
+void Relocalization::selectSegments(Mat queryDescriptors, int numOfSegments, vector<int> &segmentIndices)
+{
+    segmentIndices.clear();
+
+    // without a usable vocabulary every segment scores the same, so all of them are candidates
+    if (!vocabulary.usable())
+    {
+        for (int s=0; s<segments.size(); s++)
+            segmentIndices.push_back(s);
+        return;
+    }
+
+    vector<pair<int, double> > bestSegments;
+    vocabulary.query(queryDescriptors, numOfSegments, bestSegments);
+    for (int i=0; i<bestSegments.size(); i++)
+        segmentIndices.push_back(bestSegments[i].first);
+}
+
+int Relocalization::retrieve(Mat queryDescriptors, int numOfSegments, vector<pair<Point3d, Mat> > &candidates)
+{
+    vector<int> segmentIndices;
+    selectSegments(queryDescriptors, numOfSegments, segmentIndices);
+
+    for (int i=0; i<segmentIndices.size(); i++)
+    {
+        Segment &segment = segments[segmentIndices[i]];
+
+        // a compressed map reads its full-precision descriptors back from the store
+        Mat descriptors = segment.descriptors;
+        if (store != NULL)
+            store->getDescriptors(segment.storeIndices, descriptors);
+
+        for (int j=0; j<segment.points.size(); j++)
+            candidates.push_back(make_pair(segment.points[j], descriptors.row(j)));
+    }
+
+    return segmentIndices.size();
+}
+
+int Relocalization::retrieve(Mat queryDescriptors, int numOfSegments, vector<Point3d> &candidatePoints, vector<int> &candidateIds, vector<int> &candidateIndices)
+{
+    vector<int> segmentIndices;
+    selectSegments(queryDescriptors, numOfSegments, segmentIndices);
+
+    for (int i=0; i<segmentIndices.size(); i++)
+    {
+        Segment &segment = segments[segmentIndices[i]];
+        candidatePoints.insert(candidatePoints.end(), segment.points.begin(), segment.points.end());
+        candidateIds.insert(candidateIds.end(), segment.ids.begin(), segment.ids.end());
+        candidateIndices.insert(candidateIndices.end(), segment.storeIndices.begin(), segment.storeIndices.end());
+    }
+
+    return segmentIndices.size();
+}
+
+int Relocalization::getNumSegments()
+{
+    return segments.size();
+}
+
+int Relocalization::getNumLandmarks()
+{
+    return numLandmarks;
+}
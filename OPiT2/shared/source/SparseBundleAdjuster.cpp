@@ -0,0 +1,371 @@
+#include "SparseBundleAdjuster.h"
+#include "RobustLoss.h"
+
+#include <iostream>
+#include <vector>
+#include <cmath>
+#include <algorithm>
+
+#include <opencv2/opencv.hpp>
+#include <opencv2/core/core.hpp>
+
+using namespace std;
+using namespace cv;
+
+/* ---------------------------------------------------------------------------------------------------------
+    parallel_for_ of opencv 3.1 only takes a ParallelLoopBody, this one calls a functor for every index
+   ---------------------------------------------------------------------------------------------------------*/
+template <typename F>
+class IndexLoopBody : public ParallelLoopBody
+{
+public:
+    IndexLoopBody(const F &f) : f(f) {}
+
+    void operator()(const Range &range) const
+    {
+        for (int i=range.start; i<range.end; i++)
+            f(i);
+    }
+
+private:
+    F f;
+};
+
+template <typename F>
+static void parallelFor(int n, const F &f)
+{
+    if (n > 0)
+        parallel_for_(Range(0, n), IndexLoopBody<F>(f));
+}
+
+/* ------------------------------------------------------------------------------------------------ */
+
+// constructor
+SparseBundleAdjuster::SparseBundleAdjuster()
+{
+    this->iterations        = 20;
+    this->huber             = 2.0;
+    this->numOfFixedCameras = 1;
+    this->lambda            = 1e-3;
+}
+
+// destructor
+SparseBundleAdjuster::~SparseBundleAdjuster()
+{
+    // do nothing
+}
+
+void SparseBundleAdjuster::setParams(int iterations, double huber, int numOfFixedCameras)
+{
+    this->iterations        = iterations;
+    this->huber             = huber;
+    this->numOfFixedCameras = numOfFixedCameras;
+}
+
+double SparseBundleAdjuster::robustCost(double error)
+{
+    return huberCost(error, huber);
+}
+
+double SparseBundleAdjuster::robustWeight(double error)
+{
+    return huberWeight(error, huber);
+}
+
+/*
+    Residuals and analytic jacobians of every observation, with the same projection and the same [v, omega]
+    update as PnPSolver::optimizePose. The observations behind the camera get a zero weight.
+    Returns the robust cost.
+*/
+double SparseBundleAdjuster::linearize(const vector<Pose> &poses, const vector<Matx33d> &K,
+                                       const vector<Vec3d> &points, const vector<Observation> &observations)
+{
+    int O = observations.size();
+    Jc.resize(O);
+    Jp.resize(O);
+    residuals.resize(O);
+    weights.resize(O);
+    vector<double> costs(O);
+
+    parallelFor(O, [&](int o)
+    {
+        const Observation &obs = observations[o];
+        const Pose &pose = poses[obs.cameraIdx];
+        const Matx33d &k = K[obs.cameraIdx];
+        double fx = k(0,0), fy = k(1,1), cx = k(0,2), cy = k(1,2);
+
+        Vec3d Xc = pose.transform(points[obs.pointIdx]);
+        double x = Xc[0], y = Xc[1], z = Xc[2];
+        if (z <= 0)
+        {
+            Jc[o] = Matx26d::zeros();
+            Jp[o] = Matx23d::zeros();
+            residuals[o] = Vec2d(0, 0);
+            weights[o] = 0;
+            costs[o] = 0;
+            return;
+        }
+
+        double iz  = 1.0 / z;
+        double iz2 = iz * iz;
+        Vec2d  r(fx*x*iz + cx - obs.imagePoint.x, fy*y*iz + cy - obs.imagePoint.y);
+        double e = sqrt(r.dot(r));
+
+        // projection wrt the point in the camera frame, then chained with x' = exp(omega) * x + v and with x = R*X + t
+        Matx23d dProj(fx*iz, 0,     -fx*x*iz2,
+                      0,     fy*iz, -fy*y*iz2);
+        Jc[o] = Matx26d(fx*iz, 0,     -fx*x*iz2, -fx*x*y*iz2,      fx + fx*x*x*iz2, -fx*y*iz,
+                        0,     fy*iz, -fy*y*iz2, -fy - fy*y*y*iz2, fy*x*y*iz2,       fy*x*iz);
+        Jp[o] = dProj * pose.R;
+
+        residuals[o] = r;
+        weights[o]   = robustWeight(e);
+        costs[o]     = robustCost(e);
+    });
+
+    double cost = 0;
+    for (int o=0; o<O; o++)
+        cost += costs[o];
+    return cost;
+}
+
+double SparseBundleAdjuster::evaluate(const vector<Pose> &poses, const vector<Matx33d> &K,
+                                      const vector<Vec3d> &points, const vector<Observation> &observations)
+{
+    int O = observations.size();
+    vector<double> costs(O);
+
+    parallelFor(O, [&](int o)
+    {
+        const Observation &obs = observations[o];
+        const Matx33d &k = K[obs.cameraIdx];
+
+        Vec3d Xc = poses[obs.cameraIdx].transform(points[obs.pointIdx]);
+        if (Xc[2] <= 0)
+        {
+            costs[o] = 0;
+            return;
+        }
+
+        double eu = k(0,0)*Xc[0]/Xc[2] + k(0,2) - obs.imagePoint.x;
+        double ev = k(1,1)*Xc[1]/Xc[2] + k(1,2) - obs.imagePoint.y;
+        costs[o] = robustCost(sqrt(eu*eu + ev*ev));
+    });
+
+    double cost = 0;
+    for (int o=0; o<O; o++)
+        cost += costs[o];
+    return cost;
+}
+
+/*
+    Levenberg-Marquardt on the normal equations
+        [ U   W ] [dc]     [gc]
+        [ W^t V ] [dp] = - [gp]
+    the 3x3 point blocks V are inverted in parallel and eliminated (Schur complement), which leaves a small dense
+    system of 6*C unknowns for the cameras. The points are then recovered by back-substitution, again in parallel.
+    The points seen by a single camera can't be triangulated and are kept fixed, as are the first numOfFixedCameras poses.
+*/
+double SparseBundleAdjuster::run(vector<Pose> &poses, const vector<Matx33d> &K, vector<Point3d> &points,
+                                 const vector<Observation> &observations)
+{
+    int C = poses.size();
+    int P = points.size();
+    int O = observations.size();
+    if (C == 0 || P == 0 || O == 0)
+        return 0;
+
+    int fixed = min(numOfFixedCameras, C);
+    int F = C - fixed;
+
+    // the sweref 99 coordinates are large, the problem is solved around the centroid of the points, t' = t + R*c
+    Vec3d centroid(0, 0, 0);
+    for (int p=0; p<P; p++)
+        centroid += Vec3d(points[p].x, points[p].y, points[p].z);
+    centroid *= 1.0 / P;
+
+    vector<Vec3d> X(P);
+    for (int p=0; p<P; p++)
+        X[p] = Vec3d(points[p].x, points[p].y, points[p].z) - centroid;
+
+    vector<Pose> cams(C);
+    for (int c=0; c<C; c++)
+        cams[c] = Pose(poses[c].R, poses[c].t + poses[c].R * centroid);
+
+    byCamera.assign(C, vector<int>());
+    byPoint.assign(P, vector<int>());
+    for (int o=0; o<O; o++)
+    {
+        byCamera[observations[o].cameraIdx].push_back(o);
+        byPoint[observations[o].pointIdx].push_back(o);
+    }
+
+    vector<Matx66d> U(C);
+    vector<Vec6d>   gc(C);
+    vector<Matx33d> V(P), Vinv(P);
+    vector<Vec3d>   gp(P);
+    vector<Matx63d> W(O);
+
+    vector<Pose>    trialCams;
+    vector<Vec3d>   trialX;
+    Mat             S, b, dc;
+
+    double cost = linearize(cams, K, X, observations);
+    lambda = max(lambda, 1e-6);
+
+    for (int it=0; it<iterations; it++)
+    {
+        // blocks of the normal equations, every camera and every point is accumulated by a single thread
+        parallelFor(C, [&](int c)
+        {
+            U[c]  = Matx66d::zeros();
+            gc[c] = Vec6d(0, 0, 0, 0, 0, 0);
+            for (int i=0; i<byCamera[c].size(); i++)
+            {
+                int o = byCamera[c][i];
+                Matx<double, 6, 2> JtW = Jc[o].t() * weights[o];
+                U[c]  += JtW * Jc[o];
+                gc[c] += JtW * residuals[o];
+            }
+        });
+
+        parallelFor(P, [&](int p)
+        {
+            V[p]  = Matx33d::zeros();
+            gp[p] = Vec3d(0, 0, 0);
+            for (int i=0; i<byPoint[p].size(); i++)
+            {
+                int o = byPoint[p][i];
+                Matx<double, 3, 2> JtW = Jp[o].t() * weights[o];
+                V[p]  += JtW * Jp[o];
+                gp[p] += JtW * residuals[o];
+                W[o]   = Jc[o].t() * JtW.t();
+            }
+        });
+
+        bool accepted = false, converged = false;
+        while (!accepted && lambda < 1e10)
+        {
+            // damped point blocks, inverted in parallel
+            parallelFor(P, [&](int p)
+            {
+                if (byPoint[p].size() < 2)
+                {
+                    Vinv[p] = Matx33d::zeros();
+                    return;
+                }
+                Matx33d Vd = V[p];
+                for (int a=0; a<3; a++)
+                    Vd(a,a) += lambda * V[p](a,a) + 1e-12;
+                Vinv[p] = Vd.inv(DECOMP_CHOLESKY);
+            });
+
+            // reduced camera system S = U - W V^-1 W^t, b = gc - W V^-1 gp, every block row is built by one thread
+            S = Mat::zeros(6*F, 6*F, CV_64F);
+            b = Mat::zeros(6*F, 1, CV_64F);
+            parallelFor(F, [&](int f)
+            {
+                int c = f + fixed;
+                Matx66d Scc = U[c];
+                for (int a=0; a<6; a++)
+                    Scc(a,a) += lambda * U[c](a,a) + 1e-12;
+                Vec6d bc = gc[c];
+
+                vector<Matx66d> row(F, Matx66d::zeros());
+                row[f] = Scc;
+                for (int i=0; i<byCamera[c].size(); i++)
+                {
+                    int o = byCamera[c][i];
+                    int p = observations[o].pointIdx;
+                    if (byPoint[p].size() < 2)
+                        continue;
+
+                    Matx63d Y = W[o] * Vinv[p];
+                    bc -= Y * gp[p];
+                    for (int j=0; j<byPoint[p].size(); j++)
+                    {
+                        int o2 = byPoint[p][j];
+                        int f2 = observations[o2].cameraIdx - fixed;
+                        if (f2 >= 0)
+                            row[f2] -= Y * W[o2].t();
+                    }
+                }
+
+                for (int a=0; a<6; a++)
+                {
+                    double *s = S.ptr<double>(6*f + a);
+                    for (int f2=0; f2<F; f2++)
+                        for (int k=0; k<6; k++)
+                            s[6*f2 + k] = row[f2](a,k);
+                    b.at<double>(6*f + a) = bc[a];
+                }
+            });
+
+            if (F > 0 && !solve(S, -b, dc, DECOMP_CHOLESKY))
+            {
+                lambda *= 10;
+                continue;
+            }
+
+            trialCams = cams;
+            for (int f=0; f<F; f++)
+                trialCams[f + fixed].update(Vec6d(dc.ptr<double>(6*f)));
+
+            // back-substitution, dp = V^-1 (-gp - W^t dc)
+            trialX = X;
+            double stepNorm = (F > 0) ? norm(dc) : 0;
+            parallelFor(P, [&](int p)
+            {
+                if (byPoint[p].size() < 2)
+                    return;
+                Vec3d rhs = -gp[p];
+                for (int j=0; j<byPoint[p].size(); j++)
+                {
+                    int o = byPoint[p][j];
+                    int f = observations[o].cameraIdx - fixed;
+                    if (f >= 0)
+                        rhs -= W[o].t() * Vec6d(dc.ptr<double>(6*f));
+                }
+                trialX[p] += Vinv[p] * rhs;
+            });
+            for (int p=0; p<P; p++)
+                stepNorm += norm(trialX[p] - X[p]);
+
+            double trialCost = evaluate(trialCams, K, trialX, observations);
+            if (trialCost < cost)
+            {
+                accepted = true;
+                cams.swap(trialCams);
+                X.swap(trialX);
+                lambda = max(lambda / 3, 1e-7);
+
+                double lastCost = cost;
+                cost = linearize(cams, K, X, observations);
+                converged = (stepNorm < 1e-10 || lastCost - cost < 1e-9 * lastCost);
+            }
+            else
+                lambda *= 5;
+        }
+
+        if (!accepted || converged)
+            break;
+    }
+
+    // back to the sweref 99 frame, t = t' - R*c
+    for (int p=0; p<P; p++)
+        points[p] = Point3d(X[p][0] + centroid[0], X[p][1] + centroid[1], X[p][2] + centroid[2]);
+    for (int c=0; c<C; c++)
+        poses[c] = Pose(cams[c].R, cams[c].t - cams[c].R * centroid);
+
+    // rms reprojection error of the observations in front of the cameras
+    double sum = 0;
+    int count = 0;
+    for (int o=0; o<O; o++)
+    {
+        if (weights[o] == 0)
+            continue;
+        sum += residuals[o].dot(residuals[o]);
+        count++;
+    }
+    return (count > 0) ? sqrt(sum / count) : 0;
+}
@@ -0,0 +1,143 @@
+#include "SurfaceMask.h"
+#include "CameraModel.h"
+#include "Pose.h"
+
+#include <iostream>
+#include <vector>
+#include <cmath>
+#include <cfloat>
+
+#include <opencv2/opencv.hpp>
+#include <opencv2/core/core.hpp>
+
+#include <pcl/point_types.h>
+#include <pcl/point_cloud.h>
+#include <pcl/kdtree/kdtree_flann.h>
+
+using namespace std;
+using namespace cv;
+
+// constructor
+SurfaceMask::SurfaceMask()
+{
+    this->minDist = 10;
+    this->maxDist = 80;
+    this->scale   = 0.125;
+    this->margin  = 1;
+}
+
+SurfaceMask::SurfaceMask(double minDist, double maxDist, double scale, int margin)
+{
+    this->minDist = minDist;
+    this->maxDist = maxDist;
+    this->scale   = scale;
+    this->margin  = margin;
+}
+
+// destructor
+SurfaceMask::~SurfaceMask()
+{
+    // do nothing
+}
+
+void SurfaceMask::setDepthRange(double minDist, double maxDist)
+{
+    this->minDist = minDist;
+    this->maxDist = maxDist;
+}
+
+void SurfaceMask::setResolution(double scale, int margin)
+{
+    this->scale  = scale;
+    this->margin = margin;
+}
+
+bool SurfaceMask::render(const CameraModel &camera, Size imageSize, const Pose &pose,
+                         pcl::PointCloud<pcl::PointXYZ>::Ptr &cloud, pcl::KdTreeFLANN<pcl::PointXYZ> &kdtree,
+                         Mat &mask)
+{
+    // below this ratio of covered cells the pose is more likely wrong than the tunnel ending
+    const double MIN_COVERAGE = 0.05;
+
+    Size gridSize(max(1, cvRound(imageSize.width * scale)), max(1, cvRound(imageSize.height * scale)));
+    coverage.create(gridSize, CV_8U);
+    coverage = Scalar(0);
+
+    // the field of view as bounds of the normalized coordinates, from the undistorted image corners
+    vector<Point2d> corners{ Point2d(0, 0), Point2d(imageSize.width-1, 0),
+                             Point2d(0, imageSize.height-1), Point2d(imageSize.width-1, imageSize.height-1) };
+    vector<Point2d> undistortedCorners;
+    camera.undistort(corners, undistortedCorners);
+
+    double minX = DBL_MAX, maxX = -DBL_MAX, minY = DBL_MAX, maxY = -DBL_MAX;
+    for (int i=0; i<undistortedCorners.size(); i++)
+    {
+        Vec3d n = camera.getKinv() * Vec3d(undistortedCorners[i].x, undistortedCorners[i].y, 1);
+        minX = min(minX, n[0]); maxX = max(maxX, n[0]);
+        minY = min(minY, n[1]); maxY = max(maxY, n[1]);
+    }
+
+    // every point in the frustum up to maxDist lies within this radius around the camera
+    double radius = maxDist * sqrt(1 + max(minX*minX, maxX*maxX) + max(minY*minY, maxY*maxY));
+    Vec3d  center = pose.getCameraPosition();
+
+    indices.clear();
+    sqrDistances.clear();
+    kdtree.radiusSearch(pcl::PointXYZ(center[0], center[1], center[2]), radius, indices, sqrDistances);
+
+    // one cell per point, the pixel centers are at +0.5
+    double cellX = (double)gridSize.width  / imageSize.width;
+    double cellY = (double)gridSize.height / imageSize.height;
+    auto splat = [&](double u, double v)
+    {
+        int x = (int)floor((u + 0.5) * cellX);
+        int y = (int)floor((v + 0.5) * cellY);
+        if ((x >= 0) && (y >= 0) && (x < gridSize.width) && (y < gridSize.height))
+            coverage.at<uchar>(y, x) = 255;
+    };
+
+    bool distorted = camera.hasDistortion();
+    cameraPoints.clear();
+
+    for (int i=0; i<indices.size(); i++)
+    {
+        const pcl::PointXYZ &P = cloud->points[indices[i]];
+        Vec3d X = pose.transform(Vec3d(P.x, P.y, P.z));
+
+        // the ray march only looks for the surface within the depth range
+        if ((X[2] < minDist) || (X[2] > maxDist))
+            continue;
+
+        double x = X[0] / X[2];
+        double y = X[1] / X[2];
+        if ((x < minX) || (x > maxX) || (y < minY) || (y > maxY))
+            continue;
+
+        if (distorted)
+            cameraPoints.push_back(Point3d(X[0], X[1], X[2]));
+        else
+            splat(camera.fx * x + camera.cx, camera.fy * y + camera.cy);
+    }
+
+    if (distorted && (cameraPoints.size() != 0))
+    {
+        projectPoints(cameraPoints, Mat::zeros(3, 1, CV_64F), Mat::zeros(3, 1, CV_64F),
+                      camera.getCameraMatrix(), camera.getDistortionCoeffs(), projectedPoints);
+        for (int i=0; i<projectedPoints.size(); i++)
+            splat(projectedPoints[i].x, projectedPoints[i].y);
+    }
+
+    // close the gaps between the sparse far points, then grow the coverage by the margin
+    morphologyEx(coverage, coverage, MORPH_CLOSE, getStructuringElement(MORPH_RECT, Size(3, 3)));
+    if (margin > 0)
+        dilate(coverage, coverage, getStructuringElement(MORPH_RECT, Size(2*margin+1, 2*margin+1)));
+
+    if (countNonZero(coverage) < MIN_COVERAGE * gridSize.area())
+    {
+        mask = Mat(imageSize, CV_8U, Scalar(255));
+        return false;
+    }
+
+    resize(coverage, mask, imageSize, 0, 0, INTER_NEAREST);
+    return true;
+}
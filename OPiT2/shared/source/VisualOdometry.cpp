@@ -1,4 +1,5 @@
 #include "VisualOdometry.h"
+#include "CameraModel.h"
 
 #include <opencv2/video/tracking.hpp>
 #include <opencv2/imgproc/imgproc.hpp>
@@ -38,24 +39,27 @@ VO::VO()											// WE HAVE TO TAKE DISTORTION INTO ACCOUNT!
     imageScale = 1.0f;
 
 #ifndef KITTI_DATASET
-	// cameraMatrix.at<double>(0, 0) = 1432.f/imageScale;						// Focal length X				| fx  0  cx |
-	// cameraMatrix.at<double>(1, 1) = 1432.f/imageScale;						// Focal length Y				| 0  fy  cy |
-	// cameraMatrix.at<double>(0, 2) = 640.f/imageScale;						// Principal point X			| 0   0   1 |
-	// cameraMatrix.at<double>(1, 2) = 481.f/imageScale;						// Principal point Y			---		  ---
+	// cameraMatrix.at<double>(0, 0) = 1432.f;						// Focal length X				| fx  0  cx |
+	// cameraMatrix.at<double>(1, 1) = 1432.f;						// Focal length Y				| 0  fy  cy |
+	// cameraMatrix.at<double>(0, 2) = 640.f;						// Principal point X			| 0   0   1 |
+	// cameraMatrix.at<double>(1, 2) = 481.f;						// Principal point Y			---		  ---
 	// cameraMatrix.at<double>(2, 2) = 1.0;						// Just a 1 cause why not
-    cameraMatrix.at<double>(0, 0) = 1693.87882/imageScale;						// Focal length X				| fx  0  cx |
-	cameraMatrix.at<double>(1, 1) = 1695.69754/imageScale;						// Focal length Y				| 0  fy  cy |
-	cameraMatrix.at<double>(0, 2) = 1009.89572/imageScale;						// Principal point X			| 0   0   1 |
-	cameraMatrix.at<double>(1, 2) = 507.91942/imageScale;						// Principal point Y			---		  ---
+    cameraMatrix.at<double>(0, 0) = 1693.87882;						// Focal length X				| fx  0  cx |
+	cameraMatrix.at<double>(1, 1) = 1695.69754;						// Focal length Y				| 0  fy  cy |
+	cameraMatrix.at<double>(0, 2) = 1009.89572;						// Principal point X			| 0   0   1 |
+	cameraMatrix.at<double>(1, 2) = 507.91942;						// Principal point Y			---		  ---
 	cameraMatrix.at<double>(2, 2) = 1.0;						// Just a 1 cause why not
 
 #else
-    cameraMatrix.at<double>(0, 0) = 718.8560/imageScale;					// Focal length X				| fx  0  cx |
-    cameraMatrix.at<double>(1, 1) = 718.8560/imageScale;					// Focal length Y				| 0  fy  cy |
-    cameraMatrix.at<double>(0, 2) = 607.1928/imageScale;					// Principal point X			| 0   0   1 |
-    cameraMatrix.at<double>(1, 2) = 185.2157/imageScale;					// Principal point Y			---		  ---
+    cameraMatrix.at<double>(0, 0) = 718.8560;					// Focal length X				| fx  0  cx |
+    cameraMatrix.at<double>(1, 1) = 718.8560;					// Focal length Y				| 0  fy  cy |
+    cameraMatrix.at<double>(0, 2) = 607.1928;					// Principal point X			| 0   0   1 |
+    cameraMatrix.at<double>(1, 2) = 185.2157;					// Principal point Y			---		  ---
     cameraMatrix.at<double>(2, 2) = 1.0;						// Just a 1 cause why not
 #endif
+
+    // the images are shrunk by imageScale, so is the camera matrix
+    cameraMatrix = CameraModel::scaleCameraMatrix(cameraMatrix, 1.0 / imageScale);
 }
 
 void VO::visualodometry()
@@ -81,10 +85,10 @@ void VO::visualodometry()
     cvtColor(firstImage, firstImage, COLOR_BGR2GRAY);
     cvtColor(secondImage, secondImage, COLOR_BGR2GRAY);
 
-    if (!(int)imageScale)
+    if (imageScale != 1.0)
     {
-        resize(firstImage, firstImage, Size(firstImage.cols/imageScale, firstImage.rows/imageScale));
-        resize(secondImage, secondImage, Size(secondImage.cols/imageScale, secondImage.rows/imageScale));
+        resize(firstImage, firstImage, Size(), 1.0/imageScale, 1.0/imageScale, INTER_AREA);
+        resize(secondImage, secondImage, Size(), 1.0/imageScale, 1.0/imageScale, INTER_AREA);
     }
 
     // 3. feature detection on first and second images
@@ -148,9 +152,9 @@ void VO::findPoses(cv::Mat lastImage, std::vector<cv::Point2f>& points1, std::ve
         // working with grayscale only and resize
         cvtColor(currImg, currImg, COLOR_BGR2GRAY);
 
-        if (!(int)imageScale)
+        if (imageScale != 1.0)
         {
-            resize(currImg, currImg, Size(currImg.cols/imageScale, currImg.rows/imageScale));
+            resize(currImg, currImg, Size(), 1.0/imageScale, 1.0/imageScale, INTER_AREA);
         }
 
         // feature detection
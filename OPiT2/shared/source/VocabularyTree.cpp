@@ -0,0 +1,302 @@
+#include "VocabularyTree.h"
+#include "BinaryDescriptor.h"
+
+#include <iostream>
+#include <algorithm>
+#include <cmath>
+#include <string>
+#include <vector>
+
+#include <opencv2/opencv.hpp>
+#include <opencv2/core/core.hpp>
+
+using namespace std;
+using namespace cv;
+
+/*
+    A vocabulary tree for fast retrieval of the map segments, based on
+
+        D. Nister and H. Stewenius, "Scalable Recognition with a Vocabulary Tree", CVPR 2006
+
+    the tree is built offline by a hierarchical k-means over the map descriptors. every leaf is a visual word,
+    and every word keeps an inverted file of the map segments it occurs in. a query frame is quantized word by word
+    (k*L distances per descriptor instead of a brute-force match against the whole map) and the segments are scored
+    by an idf-weighted histogram intersection.
+*/
+
+// squared L2 distance between two descriptors
+static inline float distanceL2Sqr(const float *a, const float *b, int n)
+{
+    float sum = 0;
+    for (int i=0; i<n; i++)
+    {
+        float d = a[i] - b[i];
+        sum += d*d;
+    }
+    return sum;
+}
+
+// constructor
+VocabularyTree::VocabularyTree()
+{
+    this->branching = 10;
+    this->depth     = 4;
+    this->numWords  = 0;
+}
+
+VocabularyTree::VocabularyTree(int branching, int depth)
+{
+    this->branching = branching;
+    this->depth     = depth;
+    this->numWords  = 0;
+}
+
+// destructor
+VocabularyTree::~VocabularyTree()
+{
+    // do nothing
+}
+
+/* ---------------------------------------------------------------------------------------------------------
+    offline training and persistence
+   ---------------------------------------------------------------------------------------------------------*/
+void VocabularyTree::train(Mat descriptors)
+{
+    Mat data;
+    toFloatDescriptors(descriptors, data);
+
+    // the root node has no center, but keep a row so every node index maps to a row
+    centers = Mat::zeros(1, data.cols, CV_32F);
+    firstChild.assign(1, -1);
+    numChildren.assign(1, 0);
+    nodeWord.assign(1, -1);
+    numWords = 0;
+
+    trainNode(0, data, 0);
+
+    // a new vocabulary invalidates the inverted file
+    clearSegments();
+}
+
+void VocabularyTree::trainNode(int nodeIdx, Mat descriptors, int level)
+{
+    // a node becomes a leaf (visual word) at the last level or if it can't be splitted anymore
+    if ((level == depth) || (descriptors.rows <= branching))
+    {
+        nodeWord[nodeIdx] = numWords++;
+        return;
+    }
+
+    Mat labels, childCenters;
+    kmeans(descriptors, branching, labels,
+           TermCriteria(TermCriteria::EPS + TermCriteria::COUNT, 10, 0.1),
+           3, KMEANS_PP_CENTERS, childCenters);
+
+    // allocate the children next to each other, before going deeper
+    int first = centers.rows;
+    firstChild[nodeIdx]  = first;
+    numChildren[nodeIdx] = branching;
+    centers.push_back(childCenters);
+    firstChild.resize(centers.rows, -1);
+    numChildren.resize(centers.rows, 0);
+    nodeWord.resize(centers.rows, -1);
+
+    for (int c=0; c<branching; c++)
+    {
+        Mat subset;
+        for (int i=0; i<descriptors.rows; i++)
+            if (labels.at<int>(i) == c)
+                subset.push_back(descriptors.row(i));
+
+        if (subset.empty())
+            nodeWord[first + c] = numWords++;
+        else
+            trainNode(first + c, subset, level+1);
+    }
+}
+
+bool VocabularyTree::save(string filename)
+{
+    if (!usable())
+    {
+        cerr << "refusing to save a vocabulary of " << numWords << " words" << endl;
+        return false;
+    }
+
+    FileStorage storage(filename, FileStorage::WRITE);
+    if (!storage.isOpened())
+        return false;
+
+    storage << "branching"   << branching;
+    storage << "depth"       << depth;
+    storage << "numWords"    << numWords;
+    storage << "centers"     << centers;
+    storage << "firstChild"  << firstChild;
+    storage << "numChildren" << numChildren;
+    storage << "nodeWord"    << nodeWord;
+    storage.release();
+
+    return true;
+}
+
+bool VocabularyTree::load(string filename)
+{
+    FileStorage storage(filename, FileStorage::READ);
+    if (!storage.isOpened())
+        return false;
+
+    storage["branching"]   >> branching;
+    storage["depth"]       >> depth;
+    storage["numWords"]    >> numWords;
+    storage["centers"]     >> centers;
+    storage["firstChild"]  >> firstChild;
+    storage["numChildren"] >> numChildren;
+    storage["nodeWord"]    >> nodeWord;
+    storage.release();
+
+    if (!usable())
+    {
+        cerr << "ignoring the vocabulary of " << numWords << " words in " << filename << endl;
+        centers.release();
+        firstChild.clear();
+        numChildren.clear();
+        nodeWord.clear();
+        numWords = 0;
+    }
+
+    clearSegments();
+
+    return !empty();
+}
+
+bool VocabularyTree::empty()
+{
+    return (numWords == 0);
+}
+
+bool VocabularyTree::usable()
+{
+    return (numWords >= branching * branching);
+}
+
+int VocabularyTree::getNumWords()
+{
+    return numWords;
+}
+
+/* ---------------------------------------------------------------------------------------------------------
+    quantization, inverted file and query
+   ---------------------------------------------------------------------------------------------------------*/
+int VocabularyTree::quantize(const float *descriptor)
+{
+    int node = 0;
+
+    // go down the tree, following the closest center in every level
+    while (firstChild[node] >= 0)
+    {
+        int   best     = firstChild[node];
+        float bestDist = distanceL2Sqr(descriptor, centers.ptr<float>(best), centers.cols);
+
+        for (int c=1; c<numChildren[node]; c++)
+        {
+            int   child = firstChild[node] + c;
+            float dist  = distanceL2Sqr(descriptor, centers.ptr<float>(child), centers.cols);
+            if (dist < bestDist)
+            {
+                bestDist = dist;
+                best     = child;
+            }
+        }
+        node = best;
+    }
+
+    return nodeWord[node];
+}
+
+void VocabularyTree::addToSegment(int segmentIdx, Mat descriptors)
+{
+    if (empty())
+        return;
+
+    if (segmentIdx >= segmentSize.size())
+        segmentSize.resize(segmentIdx+1, 0);
+
+    Mat data;
+    toFloatDescriptors(descriptors, data);
+
+    for (int i=0; i<data.rows; i++)
+    {
+        vector<pair<int, int> > &postings = invertedFile[quantize(data.ptr<float>(i))];
+
+        // segments are mostly filled in order, so the matching entry is usually the last one
+        int j = (int)postings.size()-1;
+        while ((j >= 0) && (postings[j].first != segmentIdx))
+            j--;
+
+        if (j >= 0)
+            postings[j].second++;
+        else
+            postings.push_back(make_pair(segmentIdx, 1));
+    }
+
+    segmentSize[segmentIdx] += data.rows;
+}
+
+void VocabularyTree::clearSegments()
+{
+    invertedFile.assign(numWords, vector<pair<int, int> >());
+    segmentSize.clear();
+}
+
+void VocabularyTree::query(Mat descriptors, int topN, vector<pair<int, double> > &candidates)
+{
+    candidates.clear();
+    if (empty() || descriptors.empty() || segmentSize.empty())
+        return;
+
+    Mat data;
+    toFloatDescriptors(descriptors, data);
+
+    // bag of words of the query
+    vector<int> words(data.rows);
+    for (int i=0; i<data.rows; i++)
+        words[i] = quantize(data.ptr<float>(i));
+    sort(words.begin(), words.end());
+
+    int numSegments = 0;
+    for (int s=0; s<segmentSize.size(); s++)
+        if (segmentSize[s] > 0)
+            numSegments++;
+
+    // idf-weighted histogram intersection, only visiting the segments listed by the query words
+    vector<double> scores(segmentSize.size(), 0);
+    for (int i=0; i<words.size(); )
+    {
+        int w = words[i];
+        int n = 0;
+        while ((i < words.size()) && (words[i] == w)) { i++; n++; }
+
+        vector<pair<int, int> > &postings = invertedFile[w];
+        if (postings.empty())
+            continue;
+
+        double idf = log(1.0 + (double)numSegments / (double)postings.size());
+        double tfQuery = (double)n / (double)data.rows;
+
+        for (int j=0; j<postings.size(); j++)
+        {
+            double tfSegment = (double)postings[j].second / (double)segmentSize[postings[j].first];
+            scores[postings[j].first] += idf * min(tfQuery, tfSegment);
+        }
+    }
+
+    for (int s=0; s<scores.size(); s++)
+        if (scores[s] > 0)
+            candidates.push_back(make_pair(s, scores[s]));
+
+    // keep the topN only
+    int n = min(topN, (int)candidates.size());
+    partial_sort(candidates.begin(), candidates.begin()+n, candidates.end(),
+                 [](const pair<int, double> &a, const pair<int, double> &b) { return a.second > b.second; });
+    candidates.resize(n);
+}
@@ -8,6 +8,7 @@
 
 #include "Common.h"
 #include "FeatureDetection.h"
+#include "FramePreprocessor.h"
 
 using namespace std;
 using namespace cv;
@@ -33,6 +34,12 @@ int main ()
     fdet.setSiftParam(SIFT_OCTAVE, SIFT_CONTRAST, SIFT_EDGE, SIFT_SIGMA, SIFT_RATIO);
     fdet2.setSiftParam(SIFT_OCTAVE, SIFT_CONTRAST2, SIFT_EDGE2, SIFT_SIGMA, SIFT_RATIO);
 
+    // only the cached ROI mask is used, the frames are not preprocessed
+    FramePreprocessor preprocessor;
+    preprocessor.setGrayscale(false);
+    preprocessor.setUndistort(false);
+    preprocessor.setRoi(Rect2d(0, 0, 1.0, 7.0/8.0));
+
     ofstream logFile;
 
     com.createDir("log-sift-features");
@@ -54,9 +61,7 @@ int main ()
         Mat img = imread(currImgPath);
 
         Mat imgClone = img.clone();
-        Mat mask = Mat::zeros(imgClone.size(), CV_8U);
-        Mat roi (mask, Rect(0, 0, imgClone.cols, imgClone.rows*7/8));
-        roi = Scalar(255, 255, 255);
+        const Mat &mask = preprocessor.getMask(imgClone.size());
 
         fdet.siftDetector(img, detectedkpts);
         logFile << detectedkpts.size() << ", " << std::flush;
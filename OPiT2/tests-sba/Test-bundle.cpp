@@ -19,6 +19,14 @@
 #include "PnPSolver.h"
 #include "Calibration.h"
 #include "BundleAdjust.h"
+#include "Relocalization.h"
+#include "DescriptorStore.h"
+#include "MotionModel.h"
+#include "CameraModel.h"
+#include "KeyframeSelector.h"
+#include "RingBuffer.h"
+#include "FramePreprocessor.h"
+#include "SurfaceMask.h"
 
 //  all definitions of variables
 #define WINDOWSIZE              5                       // number of tracked frames every timestep
@@ -26,10 +34,55 @@
 #define PNPITERATION            1000                    // number of iteration for pnp solver
 #define PNPPIXELERROR           5                       // toleration of error pin pixel square
 #define PNPCONFIDENCE           0.99                    // confidence level of 99%
+#define PNPMETHOD               PNP_RANSAC_PROSAC       // robust pose estimation, PROSAC needs the matches ordered by score
+#define MOTIONMODEL             MOTION_CONSTANT_VELOCITY   // motion model predicting the pose prior of the pnp solver
+#define MOTIONMAXGAP            4                       // max number of frames since the last pose to use the prior
+#define PRIORGATEERROR          20                      // reprojection gate of the pose prior (in pixel)
+#define BUNDLEADJUSTMENT        1                       // windowed bundle adjustment after every frame
+#define BABACKEND               BA_BACKEND_NATIVE       // in-tree schur complement solver, BA_BACKEND_CVSBA for cvsba
+#define BAASYNC                 1                       // adjust a snapshot of the window in the background, merge it when done
+#define KEYFRAMEDISTANCE        1.0                     // travelled distance that makes a keyframe (in meter)
+#define KEYFRAMEPARALLAX        20.0                    // median image motion of the keyframe landmarks that makes a keyframe (in pixel)
+#define KEYFRAMETRACKED         0.6                     // a keyframe is needed below this ratio of the keyframe inliers
+#define KEYFRAMEINTERVAL        10                      // max number of frames between two keyframes
+#define ROIHEIGHT               7.0/8.0                 // upper part of the frame used for the features, the rest is the dashboard
+#define UNDISTORT               1                       // undistort the frames once, the solvers then see zero distortion
+#define FRAMESCALE              1.0                     // scale of the preprocessed frames
+#define SURFACEMASK             1                       // detect only where the predicted view has tunnel surface in the depth range
+#define SURFACEMINDIST          10                      // depth range of the backprojection ray march (in meter)
+#define SURFACEMAXDIST          80
+#define SURFACEMASKSCALE        0.125                   // resolution of the surface coverage, one cell per 8x8 pixels
+#define SURFACEMASKMARGIN       1                       // cells added around the coverage for the error of the predicted pose
+#define FEATURETYPE             FEATURE_SIFT            // descriptor of the whole pipeline, FEATURE_ORB/FEATURE_AKAZE for a binary map
+#define TILEDSIFT               1                       // sift per image tile on the thread pool instead of the whole image at once
+#define SIFTTILESX              4                       // number of tiles along the image width
+#define SIFTTILESY              3                       // number of tiles along the image height
+#define SIFTTILEOVERLAP         32                      // support around every tile (in pixel)
+#define SIFTTILEBUDGET          300                     // max number of keypoints per tile
+#define FEATURESCALE            1.0                     // resolution of the sift base octave, 2.0 upsampled (OpenCV), 1.0 native, 0.5 half
+#define FEATUREREFINE           1                       // refine the reduced resolution keypoints on the full resolution frame
+#define KEYPOINTBUDGET          1500                    // max number of keypoints per frame, spread by non-maximal suppression
+#define KEYPOINTGRIDX           8                       // number of selection cells along the image width
+#define KEYPOINTGRIDY           6                       // number of selection cells along the image height
+#define LAZYDESCRIPTORS         1                       // describe only the keypoints needed by the matching and the lookup table
+#define CANDIDATERADIUS         40                      // keypoints around the predicted window landmarks described for matching (in pixel)
+#define FRAMETHUMBNAIL          0                       // keep a jpeg thumbnail of every frame for debugging
 #define LENGTHFRAME             100                     // number of processed frames
 #define MINFRAMEIDX             433                     // default frame index
 #define MAXFRAMEIDX             MINFRAMEIDX-LENGTHFRAME // default frame index + length
 #define MINCORRESPONDENCES      10                       // minimum amount of 3D-to-2D correspondencs of PnP
+#define MUTUALMATCHING          1                       // mutual (cross-check) matching instead of one-way knn + ratio test
+#define VOCBRANCHING            10                      // branching factor of the vocabulary tree
+#define VOCDEPTH                4                       // depth of the vocabulary tree, 10^4 visual words
+#define SEGMENTLENGTH           20.0                    // length of a map segment for relocalization (in meter)
+#define RELOCSEGMENTS           3                       // number of candidate segments retrieved for relocalization
+#define VOCMINTRAINING          10000                   // landmarks of a run that train a missing vocabulary, every segment is a candidate before
+#define PQSUBSPACES             16                      // bytes per compressed map descriptor
+#define PQCENTROIDS             256                     // centroids per subspace of the product quantizer
+#define OPQITERATION            10                      // number of iteration for optimizing the PQ rotation
+#define PQRERANK                8                       // candidates re-ranked with the full-precision descriptors
+#define PQTRAININGSIZE          100000                  // max number of landmarks for training the codebooks
+#define PQMINTRAINING           10000                   // landmarks of a run that train missing codebooks, exact distances before
 
 //  all namespaces
 using namespace std;
@@ -40,9 +93,34 @@ using namespace pcl;
 const string cloudPath   = "/Users/januaditya/Thesis/exjobb-data/git/Offline-Positioning-in-Tunnels/OPiT2/cloud/gnistangtunneln-full-voxelized.pcd";
 const string map2Dto3D   = "/Users/januaditya/Thesis/exjobb-data/git/Offline-Positioning-in-Tunnels/OPiT/ManualCorrespondences.txt";
 const string mapDesc     = "/Users/januaditya/Thesis/exjobb-data/git/Offline-Positioning-in-Tunnels/OPiT/ManualCorrespondences.yml";
+const string mapVocab    = "/Users/januaditya/Thesis/exjobb-data/git/Offline-Positioning-in-Tunnels/OPiT2/cloud/tunnel-vocabulary.yml";
+const string mapCodebook = "/Users/januaditya/Thesis/exjobb-data/git/Offline-Positioning-in-Tunnels/OPiT2/cloud/tunnel-codebook.yml";
+const string mapRawDesc  = "/Users/januaditya/Thesis/exjobb-data/git/Offline-Positioning-in-Tunnels/OPiT2/cloud/tunnel-descriptors.raw";
+const string mapLandmark = "/Users/januaditya/Thesis/exjobb-data/git/Offline-Positioning-in-Tunnels/OPiT2/cloud/tunnel-landmarks.yml";
 const string imgPath     = "/Users/januaditya/Thesis/exjobb-data/volvo/tunnel-frames/";
 //const string imgPath     = "/Users/januaditya/Desktop/thesis/gopro/frames/";
 
+// the map files of a binary descriptor type are kept next to the SIFT ones, e.g. tunnel-vocabulary-orb.yml
+string mapFile (const string &path)
+{
+    string suffix = (FEATURETYPE == FEATURE_ORB) ? "-orb" : (FEATURETYPE == FEATURE_AKAZE) ? "-akaze" : "";
+    size_t dot = path.find_last_of('.');
+    return path.substr(0, dot) + suffix + path.substr(dot);
+}
+
+// an even subsample of the stored map descriptors, for training the codebooks and the vocabulary
+Mat sampleDescriptors (DescriptorStore &store)
+{
+    vector<int> indices;
+    int step = max(1, store.size() / PQTRAININGSIZE);
+    for (int i=0; i<store.size(); i+=step)
+        indices.push_back(i);
+
+    Mat descriptors;
+    store.getDescriptors(indices, descriptors);
+    return descriptors;
+}
+
 //  start the main
 int main (int argc, char* argv[])
 {
@@ -52,17 +130,48 @@ int main (int argc, char* argv[])
     PnPSolver solver;
     Calibration cal;
     BundleAdjust bundle;
+    Relocalization reloc(VOCBRANCHING, VOCDEPTH, SEGMENTLENGTH);
+    DescriptorStore store(PQSUBSPACES, PQCENTROIDS);
+    MotionModel motion(MOTIONMODEL, MOTIONMAXGAP);
+    KeyframeSelector keyframes(KEYFRAMEDISTANCE, KEYFRAMEPARALLAX, KEYFRAMETRACKED, KEYFRAMEINTERVAL);
+
+    bundle.setBackend(BABACKEND);
 
     // declare all variables for global lookup table
-    vector<pair<Point3d, Mat> >     _3dToDescriptorTable;
+    // lookup table of the tunnel map, only matched while the window is empty. the landmarks of the tracked frames
+    // are kept by the window itself, one segment per keyframe
+    LandmarkTable                   _3dToDescriptorTable;
 
     // declare all variables for local frame information
     vector<Point3d>                 _tunnel3D;
     vector<Point2d>                 _tunnel2D;
     Mat                             _tunnelDescriptor;
 
+    // pose prior of the pnp solver
+    Mat                             priorRVec, priorTVec;
+
     // set class objects initial parameters
     solver.setPnPParam (PNPITERATION, PNPPIXELERROR, PNPCONFIDENCE);
+    fdet.setFeatureType (FEATURETYPE);
+    if (TILEDSIFT)
+        fdet.setTileParam (SIFTTILESX, SIFTTILESY, SIFTTILEOVERLAP, SIFTTILEBUDGET);
+    else
+        fdet.setTileParam (1, 1, 0, 0);
+    fdet.setScaleParam (FEATURESCALE, FEATUREREFINE);
+    fdet.setSelectionParam (KEYPOINTGRIDX, KEYPOINTGRIDY, KEYPOINTBUDGET);
+    fdet.setLazyDescriptors (LAZYDESCRIPTORS);
+
+    // grayscale, undistortion tables and ROI mask, built once for the frame size
+    FramePreprocessor preprocessor(cal.getCameraMatrix(), cal.getDistortionCoeffs());
+    preprocessor.setRoi (Rect2d(0, 0, 1.0, ROIHEIGHT));
+    preprocessor.setUndistort (UNDISTORT);
+    preprocessor.setScale (FRAMESCALE);
+
+    // the intrinsics of the preprocessed frames are set up once and shared by every pnp solver
+    CameraModel camera(preprocessor.getCameraMatrix(), preprocessor.getDistortionCoeffs());
+
+    // the visible tunnel surface of the predicted pose, rendered from the cloud
+    SurfaceMask surface(SURFACEMINDIST, SURFACEMAXDIST, SURFACEMASKSCALE, SURFACEMASKMARGIN);
 
     // point cloud variables
     int startFrame, endFrame;                                   // marks index for frame start/end
@@ -104,17 +213,40 @@ int main (int argc, char* argv[])
          << getFieldsList (*cloud) << ")" << endl;
 
     // prepare the 2D, 3D and descriptor correspondences from files and initialise the lookuptable
-    com.prepareMap(map2Dto3D, mapDesc, ref(_tunnel2D), ref(_tunnel3D), ref(_tunnelDescriptor));
+    com.prepareMap(map2Dto3D, mapFile(mapDesc), ref(_tunnel2D), ref(_tunnel3D), ref(_tunnelDescriptor));
+    // every map landmark gets its id once, it follows the landmark through the matches and the backprojections
     com.updatelut(_tunnel3D, _tunnelDescriptor, ref(_3dToDescriptorTable));
 
+    // the tunnel map for relocalization keeps its descriptors compressed. without codebooks the relocalization
+    // uses exact distances until the run has enough landmarks to train them
+    store.open(mapFile(mapRawDesc));
+    if (!store.load(mapFile(mapCodebook)))
+        cerr << "no codebook found in " << mapFile(mapCodebook) << ", training it after " << PQMINTRAINING << " landmarks" << endl;
+    reloc.setDescriptorStore(&store);
+
+    // the tunnel map of the earlier runs, the first run starts it with the same correspondences. its landmark ids
+    // are kept, so the new landmarks get the ids after them
+    if (reloc.load(mapFile(mapLandmark)))
+    {
+        Common::reserveLandmarkIds(reloc.getMaxLandmarkId() + 1);
+        cout << "loaded the tunnel map with " << reloc.getNumLandmarks() << " landmarks in " << reloc.getNumSegments() << " segments" << endl;
+    }
+    else
+        reloc.addLandmarks(_3dToDescriptorTable);
+
+    // the vocabulary is built offline, it indexes the segments of the map
+    bool vocabularyTrained = reloc.prepareVocabulary(mapFile(mapVocab), _tunnelDescriptor);
+
     // init all objects and vars for the main sequences, in order of definition
     int frameIndex = startFrame;
     int frameCount = 0;
     char currImgPath[100];
-    vector<Frame> windowedFrame;
+    RingBuffer<Frame> windowedFrame(WINDOWSIZE);                // keyframes only, every slot also holds the landmark segment of its keyframe
+    vector<TrackedPose> recentPoses;                            // poses of the last tracked frames, for the motion model
 
     Frame current;
-    Frame prev;
+    Mat prevPosition;                                           // camera position of the last posed frame, for its translation
+    Mat surfaceMask, featureMask;                               // reused every frame
 
     
     
@@ -138,6 +270,8 @@ int main (int argc, char* argv[])
         // create local object of frame and automatically cleared every new iteration
         vector<int> matchesIndex3D;
         vector<int> matchesIndex2D;
+        vector<DMatch> mutualMatches;
+        vector<float> mutualScores;
 
         // load the image into the current frame
         sprintf(currImgPath, "%simg_%05d.png", imgPath.c_str(), frameIndex);
@@ -147,22 +281,40 @@ int main (int argc, char* argv[])
         // init current Frame
         current = Frame();
         current.frameIdx = frameCount;
-        current.image    = imread(currImgPath);
+        preprocessor.apply(imread(currImgPath), current.image);
 
         
         
-        // preprocess the image to remove visible outliers, e.g. dashboard
-        Mat mask = Mat::zeros(current.image.size(), CV_8U);
-        Mat roi (mask, Rect(0, 0, current.image.cols, current.image.rows*7/8));
-        roi = Scalar(255, 255, 255);
+        // the pose predicted from the last frames, for the surface mask, the candidate keypoints and the pnp solver
+        bool hasPrior = motion.predict(recentPoses, current.frameIdx, priorRVec, priorTVec);
+
+        // the cached region of interest mask removes visible outliers, e.g. dashboard
+        const Mat &roiMask = preprocessor.getMask();
+
+        // with a pose to start from, only the regions with tunnel surface in the range of the backprojection are
+        // searched, every other keypoint would only cost a failed ray march. the last pose stands in for a missing
+        // prediction, without any recent pose (start, lost track) the whole ROI is kept
+        bool surfaceMasked = false;
+        bool recentPose    = (recentPoses.size() != 0) && (current.frameIdx - recentPoses.back().frameIdx <= MOTIONMAXGAP);
+        if (SURFACEMASK && (hasPrior || recentPose))
+        {
+            Pose predicted = hasPrior ? Pose::fromRodrigues(priorRVec, priorTVec) : recentPoses.back().pose;
+            if (surface.render(camera, current.image.size(), predicted, cloud, kdtree, surfaceMask))
+            {
+                bitwise_and(roiMask, surfaceMask, featureMask);
+                surfaceMasked = true;
+            }
+        }
+        const Mat &mask = surfaceMasked ? featureMask : roiMask;
 
         
         
-        // detect features from current frame with provided region of interest mask
-        fdet.siftDetector(current.image, current.keypoints, mask);
+        // detect and extract the features of the current frame in one pass with provided region of interest mask,
+        // tile by tile with an even budget over the tunnel walls (TILEDSIFT)
+        fdet.extractFeatures(current.image, mask, current);
 
-        // extract feature descriptors from current frame
-        fdet.siftExtraction(current.image, current.keypoints, current.descriptors);
+        // nothing downstream needs the pixels anymore (the lazy descriptors keep the feature image)
+        current.advance(FRAME_FEATURED, FRAMETHUMBNAIL);
 
         
         
@@ -170,32 +322,97 @@ int main (int argc, char* argv[])
         // match the current frame descriptor with every frames in the window
         if (windowedFrame.size() != 0)
         {
+            // only the keypoints around the predicted projections of the window landmarks are described and matched,
+            // all of them without a prediction
+            vector<int> candidates;
+            if (LAZYDESCRIPTORS && hasPrior)
+            {
+                vector<Point3d> windowPoints;
+                vector<Point2d> predictedPoints;
+                for (int i=0; i<windowedFrame.size(); i++)
+                {
+                    const vector<Point3d> &positions = windowedFrame[i]._3dToDescriptor.getPositions();
+                    windowPoints.insert(windowPoints.end(), positions.begin(), positions.end());
+                }
+                if (windowPoints.size() != 0)
+                    projectPoints(windowPoints, priorRVec, priorTVec, camera.getCameraMatrix(), camera.getDistortionCoeffs(), predictedPoints);
+                fdet.candidateKeypoints(current.keypoints, predictedPoints, CANDIDATERADIUS, candidates);
+            }
+            else
+            {
+                candidates.resize(current.keypoints.size());
+                iota(candidates.begin(), candidates.end(), 0);
+            }
+            fdet.describeKeypoints(current, candidates);
+            candidates = current.describedKeypoints(candidates);
+
+            // the matchers see the described candidate rows, their train indices are mapped back to the keypoints
+            bool candidatesOnly = (candidates.size() != current.keypoints.size());
+            Mat currDesc = candidatesOnly ? current.getDescriptors(candidates) : current.descriptors;
+
             for (int i=windowedFrame.size()-1; i>=0; i--)
             {
                 // if not empty, then correspondences has to be checked for every frames in the window
                 lutDesc = com.getdescriptor(windowedFrame[i]._3dToDescriptor);
 
-                // match descriptor
-                fdet.bfMatcher(lutDesc, current.descriptors, current.matches);
-
-                // perform lowe's ratio test, last parameter is for cout verbose (true/false)
-                fdet.ratioTestRansac(current.matches, ref(windowedFrame[i]), ref(current), false);
+                if (MUTUALMATCHING)
+                {
+                    // match descriptor both ways in one sweep, the output is sorted by the ratio score
+                    fdet.mutualMatcher(lutDesc, currDesc, mutualMatches, mutualScores);
+                    if (candidatesOnly)
+                        for (int j=0; j<mutualMatches.size(); j++)
+                            mutualMatches[j].trainIdx = candidates[mutualMatches[j].trainIdx];
+
+                    // remove outliers with RANSAC, last parameter is for cout verbose (true/false)
+                    fdet.mutualRansac(mutualMatches, mutualScores, ref(windowedFrame[i]), ref(current), false);
+                }
+                else
+                {
+                    // match descriptor
+                    fdet.bfMatcher(lutDesc, currDesc, current.matches);
+                    if (candidatesOnly)
+                        for (int j=0; j<current.matches.size(); j++)
+                            for (int k=0; k<current.matches[j].size(); k++)
+                                current.matches[j][k].trainIdx = candidates[current.matches[j][k].trainIdx];
+
+                    // perform lowe's ratio test, last parameter is for cout verbose (true/false)
+                    fdet.ratioTestRansac(current.matches, ref(windowedFrame[i]), ref(current), false);
+                }
             }
+
+            // the matches from every frame in the window are merged by their score, the best first and one per keypoint
+            current.sortMatchedPoints();
         }
         // if window empty
         else
         {
-            // if empty, the correspondences are obtained from the lookuptable
+            // if empty, the correspondences are obtained from the lookuptable, every keypoint is a candidate
             lutDesc = com.getdescriptor(_3dToDescriptorTable);
+            fdet.describeKeypoints(current);
+            vector<int> described = current.describedKeypoints();
+            Mat currDesc = current.getDescriptors(described);
 
-            // clean LUT
-            _3dToDescriptorTable.clear();
-
-            // matcher
-            fdet.bfMatcher(lutDesc, current.descriptors, current.matches);
-
-            // perform David Lowe's ratio test. it gives 3D/2D indices to use in the next step
-            fdet.ratioTest(current.matches, ref(matchesIndex3D), ref(matchesIndex2D));
+            if (MUTUALMATCHING)
+            {
+                // mutual matcher, it gives 3D/2D indices sorted by the ratio score
+                fdet.mutualMatcher(lutDesc, currDesc, mutualMatches, mutualScores);
+                for (int i=0; i<mutualMatches.size(); i++)
+                {
+                    matchesIndex3D.push_back(mutualMatches[i].queryIdx);
+                    matchesIndex2D.push_back(described[mutualMatches[i].trainIdx]);
+                }
+            }
+            else
+            {
+                // matcher, the train indices are mapped back to the keypoints
+                fdet.bfMatcher(lutDesc, currDesc, current.matches);
+                for (int i=0; i<current.matches.size(); i++)
+                    for (int j=0; j<current.matches[i].size(); j++)
+                        current.matches[i][j].trainIdx = described[current.matches[i][j].trainIdx];
+
+                // perform David Lowe's ratio test. it gives 3D/2D indices to use in the next step
+                fdet.ratioTest(current.matches, ref(matchesIndex3D), ref(matchesIndex2D));
+            }
 
             // retrieve the 3D from the lookup table, 2D from current frame's keypoints
             if (matchesIndex2D.size() != matchesIndex3D.size())
@@ -204,35 +421,101 @@ int main (int argc, char* argv[])
             {
                 for (int i=0; i<matchesIndex2D.size(); i++)
                 {
-                    current.matchedWorldPoints.push_back(Point3d(_3dToDescriptorTable[matchesIndex3D[i]].first.x,
-                                                                 _3dToDescriptorTable[matchesIndex3D[i]].first.y,
-                                                                 _3dToDescriptorTable[matchesIndex3D[i]].first.z));
+                    current.matchedWorldPoints.push_back(_3dToDescriptorTable.getPosition(matchesIndex3D[i]));
                     current.matchedImagePoints.push_back(Point2d(current.keypoints[matchesIndex2D[i]].pt.x,
                                                                  current.keypoints[matchesIndex2D[i]].pt.y));
+                    current.matchedIds.push_back(_3dToDescriptorTable.getId(matchesIndex3D[i]));
+                    current.matchedKeypoints.push_back(matchesIndex2D[i]);
+                    current.setKeypointId(matchesIndex2D[i], _3dToDescriptorTable.getId(matchesIndex3D[i]));
                 }
             }
+
+            // clean LUT
+            _3dToDescriptorTable.clear();
         }
 
         
         
-        // once we got the 3D and 2D correspondences and bigger than min correspondences, compute the camera pose
+        // the track is lost (or the initial lookup table failed), relocalize against the candidate segments of the tunnel map
         if (current.matchedWorldPoints.size() < MINCORRESPONDENCES)
         {
-            cerr << "not enough correspondences for PnP" << endl;
-            exit(EXIT_FAILURE);
+            vector<Point3d> candidatePoints;
+            vector<int>     candidateIds;
+            vector<int>     candidateIndices;
+            // the map segments are retrieved with every described keypoint of the frame
+            fdet.describeKeypoints(current);
+            vector<int> described = current.describedKeypoints();
+            Mat currDesc = current.getDescriptors(described);
+            int numOfSegments = reloc.retrieve(currDesc, RELOCSEGMENTS, candidatePoints, candidateIds, candidateIndices);
+
+            cout << "  lost the track, relocalizing against " << candidatePoints.size() << " landmarks from "
+                 << numOfSegments << " map segments" << endl;
+
+            current.matches.clear();
+            current.matchedWorldPoints.clear();
+            current.matchedImagePoints.clear();
+            current.matchedIds.clear();
+            current.matchedKeypoints.clear();
+            current.keypointIds.assign(current.keypoints.size(), -1);
+            matchesIndex3D.clear();
+            matchesIndex2D.clear();
+
+            if (candidatePoints.size() != 0)
+            {
+                // asymmetric distance matching against the compressed candidates, re-ranked with the descriptors on disk
+                store.knnSearch(currDesc, candidateIndices, 2, PQRERANK, current.matches);
+                for (int i=0; i<current.matches.size(); i++)
+                    for (int j=0; j<current.matches[i].size(); j++)
+                        current.matches[i][j].trainIdx = described[current.matches[i][j].trainIdx];
+                fdet.ratioTest(current.matches, ref(matchesIndex3D), ref(matchesIndex2D));
+
+                for (int i=0; i<matchesIndex2D.size(); i++)
+                {
+                    current.matchedWorldPoints.push_back(candidatePoints[matchesIndex3D[i]]);
+                    current.matchedImagePoints.push_back(Point2d(current.keypoints[matchesIndex2D[i]].pt.x,
+                                                                 current.keypoints[matchesIndex2D[i]].pt.y));
+                    current.matchedIds.push_back(candidateIds[matchesIndex3D[i]]);
+                    current.matchedKeypoints.push_back(matchesIndex2D[i]);
+                    current.setKeypointId(matchesIndex2D[i], candidateIds[matchesIndex3D[i]]);
+                }
+            }
         }
-        else
+
+        // once we got the 3D and 2D correspondences and bigger than min correspondences, compute the camera pose
+        bool poseFound = false;
+        if (current.matchedWorldPoints.size() >= MINCORRESPONDENCES)
         {
             cout << "  found " << current.matchedWorldPoints.size() << " 3D points from lookup table window" << endl;
 
             // reinit solver
-            solver = PnPSolver();
+            solver = PnPSolver(camera);
             solver.setPnPParam (PNPITERATION, PNPPIXELERROR, PNPCONFIDENCE);
+            solver.setRansacMethod (PNPMETHOD);
+
+            // the pose predicted from the last frames, the full robust estimation only runs when it fails
+            if (hasPrior)
+                solver.setPosePrior(priorRVec, priorTVec, PRIORGATEERROR);
 
             solver.setImagePoints(current.matchedImagePoints);
             solver.setWorldPoints(current.matchedWorldPoints);
             cout << "  result after matching...";
-            solver.run(1);
+            poseFound = (solver.run(1) == 0);
+        }
+
+        if (!poseFound)
+        {
+            // skip the frame instead of aborting the whole run, the next frame will try to relocalize again
+            if (current.matchedWorldPoints.size() < MINCORRESPONDENCES)
+                cerr << "  not enough correspondences for PnP (" << current.matchedWorldPoints.size() << "), skipping the frame" << endl;
+            else
+                cerr << "  PnP failed with " << current.matchedWorldPoints.size() << " correspondences, skipping the frame" << endl;
+
+            frameIndex--;
+            frameCount++;
+
+            correspondences.close();
+            correspondencesRefined.close();
+            continue;
         }
 
         
@@ -241,61 +524,55 @@ int main (int argc, char* argv[])
         // find the rest image points 3D representation using backprojections
         // prepare the matrices
         {
-            current.K           = cal.getCameraMatrix();
-            current.distCoef    = cal.getDistortionCoeffs();
-            current.R           = solver.getRotationMatrix();
-            current.R_rodrigues = solver.getRotationVector();
-            current.t           = solver.getTranslationVector();
+            current.K           = camera.getCameraMatrix();
+            current.distCoef    = camera.getDistortionCoeffs();
 
-            // get the camera pose matrix (3x4). it consists of camera position and the transposed rotation matrix
-            current.cameraPose  = solver.getCameraPose();
-
-            // get the transposed/inversed rotation matrix (3x3).
-            // we can copy 3x3 upper left from the cameraPose (3x4) or just take the inverse of rotation matrix
-            current.R_invert    = current.R.inv();
-            current.t_invert    = (-(current.R_invert) * current.t);
+            // the fixed-size pose from the solver, the rotation/translation matrices, their inverse and the
+            // camera pose matrix (4x4, camera to world) are derived from it once
+            current.setPose(solver.getPose());
+            current.advance(FRAME_POSED);
 
             // for the bundle adjustment, we need every 3d points to be in camera coordinates
             current.projectWorldtoCamera();
 
             // get the camera position (3x1) as t_invert.
             // the alternative way is to copy 3x1 rightmost column from the cameraPose (3x4)
-            if (frameCount == 0)        // initial frame/camera at index-0
+            if (prevPosition.empty())   // first posed frame, the skipped frames before it have no pose
             {
                 current.t_translation   = current.t_invert;
             }
-            else                        // rest of the frames
+            else                        // rest of the frames, from the last posed one
             {
-                current.t_translation   = current.t_invert - prev.t_invert;
+                current.t_translation   = current.t_invert - prevPosition;
             }
 
             // log for matched points
             {
-                // save the current frame retrieved pair 2D and 3D
+                // save the current frame retrieved pair 2D and 3D, flushed once per frame
+                correspondences << std::fixed << setprecision(4);
                 for (int i=0; i<current.matchedImagePoints.size(); i++)
                 {
-                    correspondences << std::fixed << setprecision(4)
-                    << current.matchedWorldPoints[i].x << ", "
-                    << current.matchedWorldPoints[i].y << ", "
-                    << current.matchedWorldPoints[i].z << ", " << std::flush;
-
-                    correspondences << std::fixed << setprecision(4)
-                    << current.matchedImagePoints[i].x << ", "
-                    << current.matchedImagePoints[i].y << "\n" << std::flush;
+                    correspondences << current.matchedWorldPoints[i].x << ", "
+                                    << current.matchedWorldPoints[i].y << ", "
+                                    << current.matchedWorldPoints[i].z << ", "
+                                    << current.matchedImagePoints[i].x << ", "
+                                    << current.matchedImagePoints[i].y << "\n";
                 }
+                correspondences << std::flush;
 
                 // save the initial camera position
+                Vec3d position = current.pose.getCameraPosition();
                 logFile << std::fixed << setprecision(10)
-                        << current.cameraPose.at<double>(0,3) << ", "
-                        << current.cameraPose.at<double>(1,3) << ", "
-                        << current.cameraPose.at<double>(2,3) << "\n" << std::flush;
+                        << position[0] << ", " << position[1] << ", " << position[2] << "\n" << std::flush;
 
                 // save the initial Rotation and Translation matrices from PnP solver
+                const Matx33d &R = current.pose.R;
+                const Vec3d   &t = current.pose.t;
                 logMatrix << std::fixed << setprecision(10)
-                          << current.R.at<double>(0,0) << ", " << current.R.at<double>(0,1) << ", " << current.R.at<double>(0,2) << ", "
-                          << current.R.at<double>(1,0) << ", " << current.R.at<double>(1,1) << ", " << current.R.at<double>(1,2) << ", "
-                          << current.R.at<double>(2,0) << ", " << current.R.at<double>(2,1) << ", " << current.R.at<double>(2,2) << ", "
-                          << current.t.at<double>(0)   << ", " << current.t.at<double>(1)   << ", " << current.t.at<double>(2)   << "\n" << std::flush;
+                          << R(0,0) << ", " << R(0,1) << ", " << R(0,2) << ", "
+                          << R(1,0) << ", " << R(1,1) << ", " << R(1,2) << ", "
+                          << R(2,0) << ", " << R(2,1) << ", " << R(2,2) << ", "
+                          << t[0]   << ", " << t[1]   << ", " << t[2]   << "\n" << std::flush;
             }
         }
 
@@ -303,73 +580,142 @@ int main (int argc, char* argv[])
         
         
         
+        // the motion model only needs the poses, every tracked frame counts
+        {
+            TrackedPose tracked = { current.frameIdx, current.pose };
+            recentPoses.push_back(tracked);
+            if (recentPoses.size() > 3)
+                recentPoses.erase(recentPoses.begin());
+        }
+
+        // a frame that is not a keyframe only tracks against the window, it adds nothing to the lookup table
+        int numOfInliers = solver.getInliers().rows;
+        if (!keyframes.isKeyframe(current, numOfInliers))
+        {
+            cout << "  not a keyframe, tracking only" << endl;
+
+            prevPosition = current.t_invert;
+
+            frameIndex--;
+            frameCount++;
+
+            correspondences.close();
+            correspondencesRefined.close();
+            continue;
+        }
+
         // call the multithreaded backprojection wrapper
         com.threading(NUMTHREADS,
                       current.cameraPose,
                       current.K,
                       current.keypoints,
                       current.descriptors,
+                      current.keypointIds,                                      // landmark ids of the matched keypoints, continue their tracks
                       std::ref(cloud),
                       std::ref(kdtree),
-                      std::ref(current._3dToDescriptor),                        // pair of 3d reprojected world points & descriptors (it's not LUT)
+                      std::ref(current._3dToDescriptor),                        // 3d reprojected world points, descriptors & ids (it's not LUT)
                       std::ref(current.reprojectedWorldPoints),                 // 3d reprojected world points
                       std::ref(current.reprojectedImagePoints),                 // 2d reprojected image points
-                      std::ref(current.reprojectedIndices));                    // vector that contains reprojected points' indices
+                      std::ref(current.reprojectedIndices),                     // vector that contains reprojected points' indices
+                      std::ref(current.reprojectedIds));                        // landmark ids of the reprojected points
 
         cout << "  successfully reprojected " << current.reprojectedWorldPoints.size() << " points" << endl;
 
+        // the next selections prefer the image cells whose rays hit the tunnel
+        fdet.updateBackprojection(current.keypoints, current.reprojectedIndices);
+
+        // only the keypoints that hit the cloud enter the lookup table, so only their missing descriptors are computed.
+        // the keypoints the extractor dropped are left out of the backprojected points too, the matchers index them
+        // with the table rows
+        if (LAZYDESCRIPTORS)
+        {
+            fdet.describeKeypoints(current, current.reprojectedIndices);
+
+            int kept = 0;
+            for (int i=0; i<current.reprojectedIndices.size(); i++)
+            {
+                if (current.described[current.reprojectedIndices[i]] != 1)
+                    continue;
+                current.reprojectedWorldPoints[kept] = current.reprojectedWorldPoints[i];
+                current.reprojectedImagePoints[kept] = current.reprojectedImagePoints[i];
+                current.reprojectedIndices[kept]     = current.reprojectedIndices[i];
+                current.reprojectedIds[kept]         = current.reprojectedIds[i];
+                kept++;
+            }
+            current.reprojectedWorldPoints.resize(kept);
+            current.reprojectedImagePoints.resize(kept);
+            current.reprojectedIndices.resize(kept);
+            current.reprojectedIds.resize(kept);
+
+            current._3dToDescriptor.clear();
+            current._3dToDescriptor.append(current.reprojectedWorldPoints,
+                                           current.getDescriptors(current.reprojectedIndices),
+                                           current.reprojectedIds);
+        }
+
         
         
         // log for reprojected 3D points
         {
+            correspondencesRefined << std::fixed << setprecision(4);
             for (int i=0; i<current.reprojectedWorldPoints.size(); i++)
             {
-                correspondencesRefined << std::fixed << setprecision(4)
-                                       << current.reprojectedWorldPoints[i].x << ", "
+                correspondencesRefined << current.reprojectedWorldPoints[i].x << ", "
                                        << current.reprojectedWorldPoints[i].y << ", "
-                                       << current.reprojectedWorldPoints[i].z << ", " << std::flush;
-
-                correspondencesRefined << std::fixed << setprecision(4)
+                                       << current.reprojectedWorldPoints[i].z << ", "
                                        << current.reprojectedImagePoints[i].x << ", "
-                                       << current.reprojectedImagePoints[i].y << "\n" << std::flush;
+                                       << current.reprojectedImagePoints[i].y << "\n";
             }
+            correspondencesRefined << std::flush;
         }
 
         
         
         
-        // update LUT
-        _3dToDescriptorTable.insert(end(_3dToDescriptorTable), begin(current._3dToDescriptor), end(current._3dToDescriptor));
+        // every backprojected landmark also goes to the tunnel map, so the track can be recovered later on
+        reloc.addLandmarks(current._3dToDescriptor);
+        if (store.empty() && (store.size() >= PQMINTRAINING))
+        {
+            store.train(sampleDescriptors(store), OPQITERATION);
+            store.save(mapFile(mapCodebook));
+            cout << "  trained the codebooks from " << store.size() << " landmarks" << endl;
+        }
+        if (!vocabularyTrained && (store.size() >= VOCMINTRAINING))
+        {
+            // a lost track later in the run already ranks the segments instead of matching all of them
+            reloc.trainVocabulary(mapFile(mapVocab), sampleDescriptors(store));
+            vocabularyTrained = true;
+        }
 
-        // push frame into the window
-        windowedFrame.push_back(current);
+        // move the frame into the window, the next frames are compared against its landmarks.
+        // a full window drops its oldest keyframe together with its landmark segment
+        keyframes.setKeyframe(current, numOfInliers);
+        current.advance(FRAME_MAPPED);
+        windowedFrame.push_back(std::move(current));
 
         // execute the bundle adjustment for both motion (R|t) and the structures (worldPoints)
         // after the execution, all frames's motion and worldPoints within sliding window will be optimized
-        //bundle.run(ref(windowedFrame));
-
-        
-        
-        if (windowedFrame.size() > WINDOWSIZE)
+        // in the background mode, the last finished adjustment is merged first (the frames tracked since then
+        // are moved along), and the next one starts on a snapshot of the current window
+        if (BUNDLEADJUSTMENT && BAASYNC)
         {
-            // clear the first index elements from lookup table
-            _3dToDescriptorTable.erase(_3dToDescriptorTable.begin(), _3dToDescriptorTable.begin() + windowedFrame[0].reprojectedWorldPoints.size());
-
-            // clear the first frame inside window if the window is full
-            windowedFrame.erase(windowedFrame.begin());
+            bundle.merge(ref(windowedFrame), ref(recentPoses));
+            if (windowedFrame.size() > 1)
+                bundle.runAsync(windowedFrame);
         }
+        else if (BUNDLEADJUSTMENT && windowedFrame.size() > 1)
+            bundle.run(ref(windowedFrame), ref(recentPoses));
+
 
         
         
-        // now current becomes previous frame
-        // TODO: still don't know how to use previous frame, verification maybe?
-        prev = Frame();
-        prev = current;
+        // only the position of the previous frame is needed, the frame itself stays in the window
+        prevPosition = windowedFrame.back().t_invert;
 
         
         
         // end of sequences, go to the next frameIndex
-        frameIndex=frameIndex-2;
+        frameIndex--;
         frameCount++;
 
         // log
@@ -382,6 +728,20 @@ int main (int argc, char* argv[])
     
     
     
+    // a short run trains the missing codebooks and vocabulary from its backprojected landmarks, so the next run uses them
+    if (store.empty() && (store.size() >= PQCENTROIDS))
+    {
+        store.train(sampleDescriptors(store), OPQITERATION);
+        store.save(mapFile(mapCodebook));
+        cout << "trained the codebooks from " << store.size() << " landmarks" << endl;
+    }
+    if (!vocabularyTrained && (store.size() != 0))
+        reloc.trainVocabulary(mapFile(mapVocab), sampleDescriptors(store));
+
+    // the next run starts from the whole tunnel map, the raw descriptors are already on disk
+    store.save(mapFile(mapCodebook));
+    reloc.save(mapFile(mapLandmark));
+
     // log
     {
         logFile.close();
@@ -0,0 +1,138 @@
+// Test-pnpbatch.cpp
+//  solves the 3D-to-2D correspondences logged by test_bundle (./log/%d-poseFile.txt) again, once frame by frame
+//  and once concurrently with PnPSolver::solveBatch, and checks that both give the same poses
+#include <iostream>
+#include <vector>
+#include <fstream>
+#include <chrono>
+
+#include <opencv2/opencv.hpp>
+
+//  include all class files
+#include "Common.h"
+#include "PnPSolver.h"
+#include "CameraModel.h"
+#include "FramePreprocessor.h"
+
+//  all definitions of variables, the same as the run of test_bundle that wrote the logs
+#define PNPITERATION            1000                    // number of iteration for pnp solver
+#define PNPPIXELERROR           5                       // toleration of error pin pixel square
+#define PNPCONFIDENCE           0.99                    // confidence level of 99%
+#define PNPMETHOD               PNP_RANSAC_PROSAC       // robust pose estimation, the logged points are ordered by score
+#define UNDISTORT               1                       // the logged image points are on the undistorted frames
+#define FRAMESCALE              1.0                     // scale of the preprocessed frames
+#define LENGTHFRAME             100                     // number of processed frames
+#define MINFRAMEIDX             433                     // default frame index
+#define MAXFRAMEIDX             MINFRAMEIDX-LENGTHFRAME // default frame index + length
+#define MINCORRESPONDENCES      10                      // minimum amount of 3D-to-2D correspondencs of PnP
+#define MAXPOSITIONERROR        1e-6                    // max distance between the sequential and the batch camera positions (in meter)
+
+//  all namespaces
+using namespace std;
+using namespace cv;
+
+//  start the main
+int main (int argc, char* argv[])
+{
+    Common com;
+    int startFrame, endFrame;
+
+    // handle the input arguments
+    if (argc != 3)
+    {
+        cerr << "wrong number of input arguments..." << endl;
+        cerr << "using default parameter instead..." << endl;
+
+        startFrame = MINFRAMEIDX;
+        endFrame   = MAXFRAMEIDX;
+    }
+    else
+    {
+        startFrame = atoi(argv[1]);
+        endFrame   = atoi(argv[2]);
+    }
+
+    // the intrinsics of the preprocessed frames, as test_bundle solved them
+    FramePreprocessor preprocessor;
+    preprocessor.setUndistort (UNDISTORT);
+    preprocessor.setScale (FRAMESCALE);
+    CameraModel camera(preprocessor.getCameraMatrix(), preprocessor.getDistortionCoeffs());
+
+    // one problem per logged frame with enough correspondences
+    vector<PnPProblem> problems;
+    vector<int>        frameIndices;
+    char poseFileIdx[100];
+    for (int frameIndex = startFrame; frameIndex > endFrame; frameIndex--)
+    {
+        PnPProblem problem;
+        sprintf(poseFileIdx, "./log/%d-poseFile.txt", frameIndex);
+        com.readCsvTo3D2D(poseFileIdx, problem.worldPoints, problem.imagePoints);
+        if (problem.worldPoints.size() < MINCORRESPONDENCES)
+            continue;
+
+        problem.camera     = camera;
+        problem.iterCount  = PNPITERATION;
+        problem.repError   = PNPPIXELERROR;
+        problem.confidence = PNPCONFIDENCE;
+        problem.method     = PNPMETHOD;
+        problems.push_back(problem);
+        frameIndices.push_back(frameIndex);
+    }
+
+    if (problems.empty())
+    {
+        cerr << "no pose file with " << MINCORRESPONDENCES << " correspondences in ./log, run test_bundle first" << endl;
+        return 1;
+    }
+    cout << "solving " << problems.size() << " logged frames" << endl;
+
+    // frame by frame, as the tracking does it
+    vector<PnPResult> sequential(problems.size());
+    chrono::high_resolution_clock::time_point start = chrono::high_resolution_clock::now();
+    for (int i=0; i<problems.size(); i++)
+    {
+        PnPSolver solver(problems[i].camera);
+        solver.setPnPParam (problems[i].iterCount, problems[i].repError, problems[i].confidence);
+        solver.setRansacMethod (problems[i].method);
+        solver.setWorldPoints(problems[i].worldPoints);
+        solver.setImagePoints(problems[i].imagePoints);
+
+        sequential[i].success = (solver.run(0) == 0);
+        if (sequential[i].success)
+            sequential[i].cameraPose = solver.getCameraPose();
+    }
+    double sequentialTime = chrono::duration<double, milli>(chrono::high_resolution_clock::now() - start).count();
+
+    // every problem on the thread pool
+    vector<PnPResult> batch;
+    start = chrono::high_resolution_clock::now();
+    PnPSolver::solveBatch(problems, batch);
+    double batchTime = chrono::duration<double, milli>(chrono::high_resolution_clock::now() - start).count();
+
+    // the PROSAC sampling is seeded, so both give the same pose of every frame
+    int numSolved = 0, numMismatches = 0;
+    for (int i=0; i<problems.size(); i++)
+    {
+        bool same = (sequential[i].success == batch[i].success);
+        if (same && batch[i].success)
+        {
+            Mat positionSequential = sequential[i].cameraPose(Rect(3, 0, 1, 3));
+            Mat positionBatch      = batch[i].cameraPose(Rect(3, 0, 1, 3));
+            same = (norm(positionSequential, positionBatch) <= MAXPOSITIONERROR);
+        }
+
+        if (batch[i].success)
+            numSolved++;
+        if (!same)
+        {
+            numMismatches++;
+            cerr << "  frame " << frameIndices[i] << ": the batch pose differs from the sequential one" << endl;
+        }
+    }
+
+    cout << "solved " << numSolved << " of " << problems.size() << " frames, "
+         << numMismatches << " different from the sequential solve" << endl;
+    cout << "sequential " << sequentialTime << " ms, batch " << batchTime << " ms" << endl;
+
+    return (numMismatches == 0) ? 0 : 1;
+}
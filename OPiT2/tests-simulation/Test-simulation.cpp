@@ -12,6 +12,7 @@
 //OUR STUFF
 #include "FeatureDetection.h"
 #include "Calibration.h"
+#include "FramePreprocessor.h"
 #include "PnPSolver.h"
 #include "PointProjection.h"
 #include "PCLCloudSearch.h"
@@ -122,6 +123,12 @@ int main (int argc, char *argv[])
     Mat descTemp;
     int clearCounter = 0;
 
+    // the ROI mask is only built once, the frames are used as they are and keep their distortion
+    FramePreprocessor preprocessor;
+    preprocessor.setGrayscale(false);
+    preprocessor.setUndistort(false);
+    preprocessor.setRoi(Rect2d(0, 0, 1.0, 7.0/8.0));
+
     int idx = startFrame;
     while (idx < lastFrame)
     {
@@ -145,10 +152,8 @@ int main (int argc, char *argv[])
         Mat img = imread(nextimage);
 
         // 4.1 set the ROI (region of interest)
-        // this mask is to take only 50% upper part of the image
-        Mat img_maskUpperPart = Mat::zeros(img.size(), CV_8U);
-        Mat img_roiUpperPart (img_maskUpperPart, Rect(0, 0, img.cols, img.rows*7/8));
-        img_roiUpperPart = Scalar(255, 255, 255);
+        // this mask is to take only the upper 7/8 of the image, cached for the image size
+        const Mat &img_maskUpperPart = preprocessor.getMask(img.size());
 
         // this mask is to take 25% of the bottom right part of the image
         // Mat img_maskRightPart = Mat::zeros(img.size(), CV_8U);
@@ -158,13 +163,10 @@ int main (int argc, char *argv[])
         // combine the masks
         // Mat img_combinedMask = img_maskUpperPart | img_maskRightPart;
 
-        // 5. perform sift feature detection and get kpt_i
+        // 5-6. perform sift feature detection and extraction in one pass, get kpt_i and desc_i
         vector<KeyPoint> detectedkpts;
-        fdetect.siftDetector(img, detectedkpts, img_maskUpperPart);
-
-        // 6. perform sift feature extraction and get desc_i
         Mat descriptor;
-        fdetect.siftExtraction(img, detectedkpts, descriptor);
+        fdetect.siftDetectAndCompute(img, img_maskUpperPart, detectedkpts, descriptor);
 
         // 6.1 draw the features
         if (DRAWKPTS && (idx == startFrame))
@@ -176,8 +178,7 @@ int main (int argc, char *argv[])
 
             Mat img2 = imread(nextimage);
 
-            fdetect.siftDetector(img2, detectedkptsnonROI);
-            fdetect.siftExtraction(img2, detectedkptsnonROI, descriptorNonROI);
+            fdetect.siftDetectAndCompute(img2, Mat(), detectedkptsnonROI, descriptorNonROI);
 
             drawKeypoints(img2, detectedkptsnonROI, outputNonROI, Scalar(249, 205, 47), 4);
             drawKeypoints(img, detectedkpts, outputROI, Scalar(249, 205, 47), 4);